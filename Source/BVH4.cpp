@@ -0,0 +1,220 @@
+#include "BVH4.h"
+#include "Stats.h"
+
+#include <xmmintrin.h>
+
+BVH4::BVH4( const spvector<Object> &objects, BVHBuildMethod method ) : BVH4( BVH( objects, method ) ) {
+}
+
+BVH4::BVH4( const BVH &bvh ) : root( 0 ) {
+	primitives = bvh.getPrimitives();
+	triangleMesh = bvh.getTriangleMesh();
+	if ( bvh.getNodes().empty() ) { return; }
+
+	nodes.reserve( bvh.getNodes().size() / 3 + 1 );
+	leaves.reserve( bvh.getNodes().size() / 2 + 1 );
+	root = collapse( bvh.getNodes(), 0 );
+}
+
+int BVH4::collapse( const std::vector<LinearBVHNode> &binaryNodes, int index ) {
+	const LinearBVHNode &node = binaryNodes[index];
+	if ( node.primitiveCount > 0 ) {
+		leaves.push_back( BVH4Leaf{ node.primitivesOffset, node.primitiveCount } );
+		return ~(int)( leaves.size() - 1 );
+	}
+
+	// 表面積の大きい内部ノードから開いて子を 4 つまで増やす
+	int children[4] = { index + 1, node.secondChildOffset, -1, -1 };
+	int childCount = 2;
+	while ( childCount < 4 ) {
+		int best = -1;
+		float bestArea = 0.0f;
+		for ( int i = 0; i < childCount; i++ ) {
+			const LinearBVHNode &child = binaryNodes[children[i]];
+			if ( child.primitiveCount == 0 && ( best == -1 || child.aabb.surfaceArea() > bestArea ) ) {
+				best = i;
+				bestArea = child.aabb.surfaceArea();
+			}
+		}
+		if ( best == -1 ) { break; }
+		int opened = children[best];
+		children[best] = opened + 1;
+		children[childCount++] = binaryNodes[opened].secondChildOffset;
+	}
+
+	int nodeIndex = (int)nodes.size();
+	nodes.emplace_back();
+	for ( int i = 0; i < 4; i++ ) {
+		// 空きには絶対に当たらない裏返しの箱を入れておく
+		AABB aabb = i < childCount ? binaryNodes[children[i]].aabb
+			: AABB{ Vector3( std::numeric_limits<float>::infinity() ), Vector3( -std::numeric_limits<float>::infinity() ) };
+		for ( int axis = 0; axis < 3; axis++ ) {
+			nodes[nodeIndex].bounds[0][axis][i] = aabb.min[axis];
+			nodes[nodeIndex].bounds[1][axis][i] = aabb.max[axis];
+		}
+		nodes[nodeIndex].children[i] = -1;
+	}
+	for ( int i = 0; i < childCount; i++ ) {
+		int child = collapse( binaryNodes, children[i] );
+		nodes[nodeIndex].children[i] = child;
+	}
+	return nodeIndex;
+}
+
+bool BVH4::intersect( const Ray &ray, Hit *hit, const std::shared_ptr<ObjectStructureIteratorHistory> &history, std::shared_ptr<ObjectStructureIteratorHistory> *newHistory ) {
+	int selectedLeaf = -1;
+	const PrecomputedRay precomputed( ray );
+	int nodesVisited = 0;
+	int primitiveTests = 0;
+
+	auto intersectLeaf = [&]( int leafIndex ) {
+		const BVH4Leaf &leaf = leaves[leafIndex];
+		primitiveTests += leaf.primitiveCount;
+		const int end = leaf.primitivesOffset + leaf.primitiveCount;
+		if ( triangleMesh != nullptr ) {
+			for ( int i = leaf.primitivesOffset; i < end; i++ ) {
+				if ( triangleMesh->intersect( i, precomputed, hit ) ) {
+					selectedLeaf = leafIndex;
+				}
+			}
+			return;
+		}
+		for ( int i = leaf.primitivesOffset; i < end; i++ ) {
+			if ( primitives[i]->intersect( ray, precomputed, hit ) ) {
+				selectedLeaf = leafIndex;
+			}
+		}
+	};
+
+	if ( !leaves.empty() ) {
+		int historyLeaf = history != nullptr ? std::static_pointer_cast<BVH4IteratorHistory>( history )->lastSelectedLeaf : -1;
+		if ( historyLeaf >= 0 ) {
+			intersectLeaf( historyLeaf );
+		}
+
+		const __m128 o[3] = { _mm_set1_ps( precomputed.o.x ), _mm_set1_ps( precomputed.o.y ), _mm_set1_ps( precomputed.o.z ) };
+		const __m128 invD[3] = { _mm_set1_ps( precomputed.invD.x ), _mm_set1_ps( precomputed.invD.y ), _mm_set1_ps( precomputed.invD.z ) };
+		const __m128 farScale = _mm_set1_ps( AABB::farScale );
+
+		struct StackEntry {
+			int ref;
+			float tNear;
+		};
+		StackEntry stack[maxStackSize];
+		int stackSize = 0;
+		stack[stackSize++] = StackEntry{ root, 0.0f };
+
+		while ( stackSize > 0 ) {
+			const StackEntry entry = stack[--stackSize];
+			if ( entry.tNear >= hit->t ) { continue; }
+
+			if ( entry.ref < 0 ) {
+				if ( ~entry.ref != historyLeaf ) {
+					intersectLeaf( ~entry.ref );
+				}
+				continue;
+			}
+
+			const BVH4Node &node = nodes[entry.ref];
+			nodesVisited++;
+			__m128 tNear = _mm_setzero_ps();
+			__m128 tFar = _mm_set1_ps( std::numeric_limits<float>::infinity() );
+			for ( int axis = 0; axis < 3; axis++ ) {
+				const int sign = precomputed.sign[axis];
+				tNear = _mm_max_ps( tNear, _mm_mul_ps( _mm_sub_ps( _mm_load_ps( node.bounds[sign][axis] ), o[axis] ), invD[axis] ) );
+				tFar = _mm_min_ps( tFar, _mm_mul_ps( _mm_sub_ps( _mm_load_ps( node.bounds[1 - sign][axis] ), o[axis] ), invD[axis] ) );
+			}
+			tFar = _mm_min_ps( _mm_mul_ps( tFar, farScale ), _mm_set1_ps( hit->t ) );
+			const int mask = _mm_movemask_ps( _mm_cmple_ps( tNear, tFar ) );
+			if ( mask == 0 ) { continue; }
+
+			alignas( 16 ) float tNears[4];
+			_mm_store_ps( tNears, tNear );
+
+			// 遠い順に積んで, 近いものから取り出す
+			StackEntry hits[4];
+			int hitCount = 0;
+			for ( int i = 0; i < 4; i++ ) {
+				if ( !( mask & ( 1 << i ) ) ) { continue; }
+				int j = hitCount++;
+				while ( j > 0 && hits[j - 1].tNear < tNears[i] ) {
+					hits[j] = hits[j - 1];
+					j--;
+				}
+				hits[j] = StackEntry{ node.children[i], tNears[i] };
+			}
+			if ( stackSize + hitCount > maxStackSize ) { abortOnTraversalStackOverflow(); }
+			for ( int i = 0; i < hitCount; i++ ) {
+				stack[stackSize++] = hits[i];
+			}
+		}
+	}
+
+	if ( newHistory != nullptr ) {
+		*newHistory = std::make_shared<BVH4IteratorHistory>( selectedLeaf );
+	}
+
+	Stats::add( StatCounter::NodesVisited, nodesVisited );
+	Stats::add( StatCounter::BoxTests, nodesVisited * 4 );
+	Stats::add( StatCounter::PrimitiveTests, primitiveTests );
+
+	return selectedLeaf >= 0;
+}
+
+bool BVH4::occluded( const Ray &ray, float tMax ) {
+	if ( leaves.empty() ) { return false; }
+
+	const PrecomputedRay precomputed( ray );
+	const __m128 o[3] = { _mm_set1_ps( precomputed.o.x ), _mm_set1_ps( precomputed.o.y ), _mm_set1_ps( precomputed.o.z ) };
+	const __m128 invD[3] = { _mm_set1_ps( precomputed.invD.x ), _mm_set1_ps( precomputed.invD.y ), _mm_set1_ps( precomputed.invD.z ) };
+	const __m128 farScale = _mm_set1_ps( AABB::farScale );
+	const __m128 tMax4 = _mm_set1_ps( tMax );
+
+	// tMax が縮まないので並べ替えはせず, 当たった子をそのまま積む
+	int stack[maxStackSize];
+	int stackSize = 0;
+	stack[stackSize++] = root;
+	int nodesVisited = 0;
+	int primitiveTests = 0;
+	bool found = false;
+
+	while ( stackSize > 0 && !found ) {
+		const int ref = stack[--stackSize];
+
+		if ( ref < 0 ) {
+			const BVH4Leaf &leaf = leaves[~ref];
+			for ( int i = leaf.primitivesOffset; i < leaf.primitivesOffset + leaf.primitiveCount; i++ ) {
+				primitiveTests++;
+				if ( triangleMesh != nullptr ? triangleMesh->occluded( i, precomputed, tMax ) : primitives[i]->occluded( ray, precomputed, tMax ) ) {
+					found = true;
+					break;
+				}
+			}
+			continue;
+		}
+
+		const BVH4Node &node = nodes[ref];
+		nodesVisited++;
+		__m128 tNear = _mm_setzero_ps();
+		__m128 tFar = _mm_set1_ps( std::numeric_limits<float>::infinity() );
+		for ( int axis = 0; axis < 3; axis++ ) {
+			const int sign = precomputed.sign[axis];
+			tNear = _mm_max_ps( tNear, _mm_mul_ps( _mm_sub_ps( _mm_load_ps( node.bounds[sign][axis] ), o[axis] ), invD[axis] ) );
+			tFar = _mm_min_ps( tFar, _mm_mul_ps( _mm_sub_ps( _mm_load_ps( node.bounds[1 - sign][axis] ), o[axis] ), invD[axis] ) );
+		}
+		tFar = _mm_min_ps( _mm_mul_ps( tFar, farScale ), tMax4 );
+		int mask = _mm_movemask_ps( _mm_cmple_ps( tNear, tFar ) );
+
+		if ( stackSize + 4 > maxStackSize ) { abortOnTraversalStackOverflow(); }
+		for ( int i = 0; i < 4; i++ ) {
+			if ( mask & ( 1 << i ) ) {
+				stack[stackSize++] = node.children[i];
+			}
+		}
+	}
+
+	Stats::add( StatCounter::NodesVisited, nodesVisited );
+	Stats::add( StatCounter::BoxTests, nodesVisited * 4 );
+	Stats::add( StatCounter::PrimitiveTests, primitiveTests );
+	return found;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "General.h"
+#include "Geometry.h"
+#include "ObjectStructure.h"
+
+// 子 4 つの AABB を軸ごとに並べて, SSE で 4 つまとめて判定する
+struct alignas(64) BVH4Node {
+	float bounds[2][3][4]; // [min/max][x/y/z][子]
+	int children[4];       // 0 以上なら内部ノード, 負なら ~葉の番号
+};
+
+struct BVH4Leaf {
+	int primitivesOffset;
+	int primitiveCount;
+};
+
+struct BVH4IteratorHistory : public ObjectStructureIteratorHistory {
+	BVH4IteratorHistory(int lastSelectedLeaf) : lastSelectedLeaf(lastSelectedLeaf) {}
+	int lastSelectedLeaf;
+};
+
+// 二分木の BVH を作ってから 4 分木に潰したもの
+class BVH4 : public ObjectStructure {
+public:
+	BVH4(const spvector<Object> &objects, BVHBuildMethod method = BVHBuildMethod::BinnedSAH);
+	explicit BVH4(const BVH &bvh);
+
+	// 汎用の走査は総当たりで済ませる. 普段は intersect を使う
+	// メッシュの三角形は PrimitiveObject ではないので返せない. メッシュでは intersect, occluded だけを使う
+	virtual std::shared_ptr<ObjectStructureIterator> traverse(const Ray& ray, std::shared_ptr<ObjectStructureIteratorHistory> history) {
+		assert(triangleMesh == nullptr);
+		return std::make_shared<NaiveObjectStructureIterator>(primitives);
+	}
+	virtual bool intersect(const Ray& ray, Hit *hit, const std::shared_ptr<ObjectStructureIteratorHistory> &history = nullptr, std::shared_ptr<ObjectStructureIteratorHistory> *newHistory = nullptr);
+	virtual bool occluded(const Ray& ray, float tMax);
+
+private:
+	static const int maxStackSize = 256;
+
+	int collapse(const std::vector<LinearBVHNode> &binaryNodes, int index);
+
+	std::vector<BVH4Node> nodes;
+	std::vector<BVH4Leaf> leaves;
+	spvector<PrimitiveObject> primitives;
+	std::shared_ptr<const TriangleMesh> triangleMesh; // あれば葉の i 番目は三角形 i
+	int root;
+};
@@ -0,0 +1,377 @@
+#include "General.h"
+
+#include <chrono>
+#include <fstream>
+#include <string>
+
+#include "Geometry.h"
+#include "GeometryUtils.h"
+#include "Scene.h"
+#include "Material.h"
+#include "Mesh.h"
+#include "Texture.h"
+#include "Sampler.h"
+#include "ObjectStructure.h"
+
+// カーネルごとのマイクロベンチマーク
+// 入力は固定シードで先に作っておいて, 暖機してから 5 回計って一番速いのを出す
+//
+//   Benchmark [シーンのディレクトリ (Scene/)] [名前に含まれる文字列で絞り込み]
+
+namespace {
+
+const int repeatCount = 5;
+const double minSeconds = 0.05; // 1 回の計測がこれより短くならないように回数を増やす
+
+std::string filter;
+volatile float sink; // 最適化で消されないように結果を流し込む
+
+template <class F>
+void runBenchmark( const std::string &name, int opsPerCall, bool isRay, F &&f ) {
+	if ( !filter.empty() && name.find( filter ) == std::string::npos ) { return; }
+
+	using Clock = std::chrono::steady_clock;
+	auto measure = [&]( int iterations ) {
+		float acc = 0.0f;
+		const auto start = Clock::now();
+		for ( int i = 0; i < iterations; i++ ) {
+			acc += f();
+		}
+		const double seconds = std::chrono::duration<double>( Clock::now() - start ).count();
+		sink = acc;
+		return seconds;
+	};
+
+	// 暖機を兼ねて回数を決める
+	int iterations = 1;
+	while ( measure( iterations ) < minSeconds ) {
+		iterations *= 2;
+	}
+
+	double best = std::numeric_limits<double>::infinity();
+	for ( int r = 0; r < repeatCount; r++ ) {
+		const double seconds = measure( iterations );
+		if ( seconds < best ) { best = seconds; }
+	}
+
+	const double nsPerOp = best / ( (double)iterations * opsPerCall ) * 1e9;
+	if ( isRay ) {
+		printf( "%-44s %10.2f ns/op %10.3f Mrays/s\n", name.c_str(), nsPerOp, 1e3 / nsPerOp );
+	} else {
+		printf( "%-44s %10.2f ns/op\n", name.c_str(), nsPerOp );
+	}
+}
+
+bool fileExists( const std::string &filename ) {
+	return std::ifstream( filename ).good();
+}
+
+Vector3 randomInBox( const AABB &aabb ) {
+	return Vector3( randf( aabb.min.x, aabb.max.x ), randf( aabb.min.y, aabb.max.y ), randf( aabb.min.z, aabb.max.z ) );
+}
+
+Vector3 randomDirection() {
+	const float z = randf( -1.0f, 1.0f );
+	const float phi = randf( 2.0f * PI );
+	const float r = sqrtf( max( 0.0f, 1.0f - z * z ) );
+	return Vector3( r * cosf( phi ), r * sinf( phi ), z );
+}
+
+Vector3 cosineDirection( const Vector3 &n ) {
+	BasisVector basis = genBasisVector( n );
+	const float r1 = randf();
+	const float r2 = randf();
+	return basis.vector( sqrtf( r2 ), cosf( 2 * PI * r1 ) * sqrtf( 1 - r2 ), sinf( 2 * PI * r1 ) * sqrtf( 1 - r2 ) );
+}
+
+Ray makeRay( const Vector3 &o, const Vector3 &d ) {
+	Ray ray;
+	ray.o = o;
+	ray.d = d;
+	ray.depth = 1;
+	return ray;
+}
+
+// center の周りを狙うレイ. 半分くらい当たるように少しずらす
+Ray makeRayToward( const Vector3 &center, float spread ) {
+	const Vector3 o = center + randomDirection() * 5.0f;
+	const Vector3 target = center + randomDirection() * spread;
+	return makeRay( o, ( target - o ).normalized() );
+}
+
+void benchmarkPrimitives() {
+	const int count = 4096;
+
+	{
+		std::vector<AABB> boxes( count );
+		std::vector<PrecomputedRay> rays;
+		rays.reserve( count );
+		for ( int i = 0; i < count; i++ ) {
+			const Vector3 c = randomDirection();
+			const Vector3 size( randf( 0.1f, 1.0f ), randf( 0.1f, 1.0f ), randf( 0.1f, 1.0f ) );
+			boxes[i] = AABB{ c - size * 0.5f, c + size * 0.5f };
+			rays.emplace_back( makeRayToward( c, 1.0f ) );
+		}
+		runBenchmark( "AABB::getIntersection", count, true, [&]() {
+			float acc = 0.0f;
+			for ( int i = 0; i < count; i++ ) {
+				float tNear, tFar;
+				if ( boxes[i].getIntersection( rays[i], 0.0f, std::numeric_limits<float>::infinity(), &tNear, &tFar ) ) { acc += tNear; }
+			}
+			return acc;
+		} );
+	}
+
+	{
+		std::vector<std::shared_ptr<Triangle>> triangles( count );
+		std::vector<Ray> rays( count );
+		for ( int i = 0; i < count; i++ ) {
+			const Vector3 c = randomDirection();
+			auto triangle = std::make_shared<Triangle>();
+			for ( int k = 0; k < 3; k++ ) {
+				triangle->v[k].p = c + randomDirection() * 0.5f;
+			}
+			triangle->calcNormal();
+			triangles[i] = triangle;
+			rays[i] = makeRayToward( c, 0.5f );
+		}
+		std::vector<PrecomputedRay> precomputed( rays.begin(), rays.end() );
+		runBenchmark( "Triangle::intersect", count, true, [&]() {
+			float acc = 0.0f;
+			for ( int i = 0; i < count; i++ ) {
+				Hit hit;
+				if ( triangles[i]->intersect( rays[i], precomputed[i], &hit ) ) { acc += hit.t; }
+			}
+			return acc;
+		} );
+		runBenchmark( "Triangle::getIntersection", count, true, [&]() {
+			float acc = 0.0f;
+			for ( int i = 0; i < count; i++ ) {
+				auto intersection = triangles[i]->getIntersection( rays[i] );
+				if ( intersection ) { acc += intersection->t; }
+			}
+			return acc;
+		} );
+
+		// 同じ三角形を頂点を共有しない TriangleMesh にしたもの
+		TriangleMesh mesh;
+		mesh.materials.push_back( nullptr );
+		for ( int i = 0; i < count; i++ ) {
+			for ( int k = 0; k < 3; k++ ) {
+				mesh.indices.push_back( (uint32_t)mesh.positions.size() );
+				mesh.positions.push_back( triangles[i]->v[k].p );
+				mesh.normals.push_back( triangles[i]->v[k].n );
+				mesh.texCoords.push_back( triangles[i]->v[k].texCoord );
+			}
+			mesh.materialIds.push_back( 0 );
+		}
+		runBenchmark( "TriangleMesh::intersect", count, true, [&]() {
+			float acc = 0.0f;
+			for ( int i = 0; i < count; i++ ) {
+				Hit hit;
+				if ( mesh.intersect( i, precomputed[i], &hit ) ) { acc += hit.t; }
+			}
+			return acc;
+		} );
+	}
+
+	{
+		std::vector<std::shared_ptr<Sphere>> spheres( count );
+		std::vector<Ray> rays( count );
+		for ( int i = 0; i < count; i++ ) {
+			const Vector3 c = randomDirection();
+			spheres[i] = std::make_shared<Sphere>( c, randf( 0.1f, 0.5f ), nullptr );
+			rays[i] = makeRayToward( c, 0.5f );
+		}
+		std::vector<PrecomputedRay> precomputed( rays.begin(), rays.end() );
+		runBenchmark( "Sphere::intersect", count, true, [&]() {
+			float acc = 0.0f;
+			for ( int i = 0; i < count; i++ ) {
+				Hit hit;
+				if ( spheres[i]->intersect( rays[i], precomputed[i], &hit ) ) { acc += hit.t; }
+			}
+			return acc;
+		} );
+		runBenchmark( "Sphere::getIntersection", count, true, [&]() {
+			float acc = 0.0f;
+			for ( int i = 0; i < count; i++ ) {
+				auto intersection = spheres[i]->getIntersection( rays[i] );
+				if ( intersection ) { acc += intersection->t; }
+			}
+			return acc;
+		} );
+	}
+}
+
+// みつ豆のメッシュに対して, カメラから / 拡散反射 / 影 の 3 種類のレイを投げる
+// メッシュの BVH は一度作ると使い回されるので, 種類ごとにメッシュから読み直す. 最後に作ったシーンを返す
+std::shared_ptr<Scene> benchmarkTraversal( const std::string &meshFile, std::vector<Intersection> *surfacePoints ) {
+	const int count = 16384;
+	const Vector3 cameraPosition( -0.6f, 10, -6.5f );
+	const Vector3 lightCenter( 0.0f, 20.0f, -5.0f );
+	const float lightSize = 16.0f;
+
+	const ObjectStructureType types[] = { ObjectStructureType::BVH, ObjectStructureType::BVH4 };
+	const char *typeNames[] = { "BVH", "BVH4" };
+	std::shared_ptr<Scene> scene;
+	for ( int t = 0; t < 2; t++ ) {
+		auto mesh = std::make_shared<Mesh>();
+		if ( !mesh->loadFile( meshFile ) ) {
+			printf( "%s cannot be read. skip traversal benchmarks.\n", meshFile.c_str() );
+			return std::make_shared<Scene>();
+		}
+		scene = std::make_shared<Scene>();
+		scene->addObject( mesh->createInstance( Transform( Vector3( 0, 0, 0 ), Vector3( 1 ), Quaternion::quaternionRotationAxis( Vector3( 0, 1, 0 ), 0.0f ) ) ) );
+
+		seedRandom( 1, 0 );
+		auto structure = scene->buildObjectStructure( types[t], BVHBuildMethod::BinnedSAH );
+
+		std::vector<Ray> primaryRays( count );
+		for ( auto &ray : primaryRays ) {
+			ray = makeRay( cameraPosition, ( randomInBox( mesh->getAABB() ) - cameraPosition ).normalized() );
+		}
+
+		// カメラから当たった点から, 次のレイと影のレイを作る
+		std::vector<Ray> diffuseRays;
+		std::vector<Ray> shadowRays;
+		std::vector<float> shadowDistances;
+		for ( const auto &ray : primaryRays ) {
+			auto intersection = scene->getIntersection( ray, nullptr, nullptr );
+			if ( !intersection || intersection->object == nullptr ) { continue; }
+			const Vector3 n = dot( intersection->n, ray.d ) < 0.0f ? intersection->n : -intersection->n;
+			const Vector3 o = intersection->p + n * 1e-4f;
+			diffuseRays.push_back( makeRay( o, cosineDirection( n ) ) );
+
+			const Vector3 l = lightCenter + Vector3( randf( -lightSize, lightSize ), 0.0f, randf( -lightSize, lightSize ) );
+			const float dist = ( l - o ).length();
+			shadowRays.push_back( makeRay( o, ( l - o ) / dist ) );
+			shadowDistances.push_back( dist );
+
+			// 返すシーンの上の点にしておく
+			if ( t == 1 ) {
+				surfacePoints->push_back( *intersection );
+			}
+		}
+
+		const std::string prefix = std::string( typeNames[t] ) + " ";
+		runBenchmark( prefix + "closest hit (primary)", (int)primaryRays.size(), true, [&]() {
+			float acc = 0.0f;
+			for ( const auto &ray : primaryRays ) {
+				Hit hit;
+				if ( structure->intersect( ray, &hit ) ) { acc += hit.t; }
+			}
+			return acc;
+		} );
+		runBenchmark( prefix + "closest hit (diffuse bounce)", (int)diffuseRays.size(), true, [&]() {
+			float acc = 0.0f;
+			for ( const auto &ray : diffuseRays ) {
+				Hit hit;
+				if ( structure->intersect( ray, &hit ) ) { acc += hit.t; }
+			}
+			return acc;
+		} );
+		runBenchmark( prefix + "occluded (shadow)", (int)shadowRays.size(), true, [&]() {
+			float acc = 0.0f;
+			for ( int i = 0; i < (int)shadowRays.size(); i++ ) {
+				if ( structure->occluded( shadowRays[i], shadowDistances[i] ) ) { acc += 1.0f; }
+			}
+			return acc;
+		} );
+	}
+	return scene;
+}
+
+void benchmarkMaterials( const std::shared_ptr<Scene> &scene, const std::vector<Intersection> &surfacePoints, const std::shared_ptr<Texture> &texture ) {
+	if ( surfacePoints.empty() ) { return; }
+
+	// メッシュの読み込みで使っているのと同じくらいのパラメータ
+	std::vector<std::pair<std::string, std::shared_ptr<Material>>> materials = {
+		{ "Diffuse", std::make_shared<Diffuse>( Vector3( 0.2f ) ) },
+		{ "DipoleSSS", std::make_shared<DipoleSSS>( Vector3( 0.6f, 0.3f, 0.1f ), 30.0f, 1.35f, 0.1f ) },
+		{ "GGXReflection", std::make_shared<GGXReflection>( Vector3( 0.15f ), 0.1f ) },
+		{ "GGXRefraction", std::make_shared<GGXRefraction>( 1.2f, 0.001f ) },
+		{ "IsotopicMedia", std::make_shared<IsotopicMedia>() },
+		{ "NullSurface", std::make_shared<NullSurface>() },
+	};
+	if ( texture ) {
+		materials.emplace_back( "DiffuseTextured", std::make_shared<DiffuseTextured>( texture ) );
+		materials.emplace_back( "GGXTextured", std::make_shared<GGXTextured>( texture, 0.04f ) );
+	}
+
+	const int count = (int)surfacePoints.size();
+	std::vector<Ray> inRays( count );
+	for ( int i = 0; i < count; i++ ) {
+		inRays[i] = makeRay( surfacePoints[i].p + surfacePoints[i].i, -surfacePoints[i].i );
+	}
+
+	SobolSampler sampler;
+	for ( const auto &material : materials ) {
+		std::vector<Intersection> intersections = surfacePoints;
+		for ( auto &intersection : intersections ) {
+			intersection.material = material.second;
+		}
+
+		uint32_t sampleIndex = 0;
+		runBenchmark( material.first + "::sampleRay", count, false, [&]() {
+			float acc = 0.0f;
+			for ( int i = 0; i < count; i++ ) {
+				sampler.startPixelSample( i, sampleIndex );
+				const SampledRay sample = material.second->sampleRay( inRays[i], intersections[i], scene, nullptr, sampler );
+				acc += sample.d.x;
+			}
+			sampleIndex++;
+			return acc;
+		} );
+	}
+}
+
+void benchmarkTexture( const std::shared_ptr<Texture> &texture ) {
+	if ( !texture ) { return; }
+
+	const int count = 4096;
+	std::vector<Vector2> uvs( count );
+	for ( auto &uv : uvs ) {
+		uv = Vector2( randf(), randf() );
+	}
+	runBenchmark( "Texture::getTexel", count, false, [&]() {
+		float acc = 0.0f;
+		for ( const auto &uv : uvs ) {
+			acc += texture->getTexel( uv ).x;
+		}
+		return acc;
+	} );
+}
+
+};
+
+int main( int argc, char **argv ) {
+	const std::string sceneDirectory = argc > 1 ? argv[1] : "Scene/";
+	filter = argc > 2 ? argv[2] : "";
+
+	seedRandom( 0, 0 );
+	benchmarkPrimitives();
+
+	const std::string meshFile = sceneDirectory + "mitsumame.obj";
+	const std::string textureFile = sceneDirectory + "wood.jpg";
+
+	std::shared_ptr<Texture> texture;
+	if ( fileExists( textureFile ) ) {
+		texture = std::make_shared<Texture>( textureFile );
+	} else {
+		printf( "%s not found. skip texture benchmarks.\n", textureFile.c_str() );
+	}
+
+	std::vector<Intersection> surfacePoints;
+	auto scene = std::make_shared<Scene>();
+	if ( fileExists( meshFile ) ) {
+		scene = benchmarkTraversal( meshFile, &surfacePoints );
+	} else {
+		printf( "%s not found. skip traversal and material benchmarks.\n", meshFile.c_str() );
+	}
+
+	seedRandom( 2, 0 );
+	benchmarkMaterials( scene, surfacePoints, texture );
+	benchmarkTexture( texture );
+
+	return 0;
+}
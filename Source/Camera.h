@@ -0,0 +1,29 @@
+#pragma once
+
+#include "General.h"
+#include "Geometry.h"
+
+struct Camera {
+	Vector3 position;
+	Vector3 eye;
+	Vector3 up;
+	float horizontalFOV;
+	float aspect;
+
+	Ray getRay( float u, float v ) {
+		// u [-1, 1]
+		// v [-1, 1]
+
+		float verticalFOV = horizontalFOV * aspect;
+		Vector3 right = cross( eye, up );
+
+		Vector3 d = ( eye + u * tanf( horizontalFOV / 2.0f * ToRad ) * right + v * tanf( verticalFOV / 2.0f * ToRad ) * up ).normalize();
+
+		Ray ray;
+		ray.o = position;
+		ray.d = d;
+		ray.depth = 1;
+
+		return std::move( ray );
+	}
+};
@@ -16,10 +16,14 @@
 #include <math.h>
 #include <memory>
 #include <random>
+#include <atomic>
 #include <functional>
 #include <algorithm>
 #include <stack>
 #include <cassert>
+#include <cfloat>
+#include <cstdint>
+#include <limits>
 
 
 template<class T> using spvector = std::vector<std::shared_ptr<T>>;
@@ -42,11 +46,59 @@ inline float clampPositive(float x) { return max(x, 0.0f); }
 inline bool inRange(float x, float minVal, float maxVal) { return minVal <= x && x <= maxVal; }
 inline bool inRange01(float x) { return inRange(x, 0.0f, 1.0f); }
 
-static std::random_device seed_gen;
-static std::mt19937 engine(seed_gen());
-static std::uniform_real_distribution<float> dist(0.0, 1.0);
+// PCG32 (O'Neill 2014). 状態が 16 バイトしかないのでスレッドごとに持たせる
+class PCG32 {
+public:
+	PCG32( uint64_t initState = 0x853c49e6748fea9bULL, uint64_t stream = 0xda3e39cb94b95bdbULL ) { seed( initState, stream ); }
+
+	void seed( uint64_t initState, uint64_t stream ) {
+		state = 0;
+		inc = ( stream << 1 ) | 1;
+		next();
+		state += initState;
+		next();
+	}
+
+	uint32_t next() {
+		uint64_t old = state;
+		state = old * 6364136223846793005ULL + inc;
+		uint32_t xorshifted = (uint32_t)( ( ( old >> 18 ) ^ old ) >> 27 );
+		uint32_t rot = (uint32_t)( old >> 59 );
+		return ( xorshifted >> rot ) | ( xorshifted << ( ( 32 - rot ) & 31 ) );
+	}
+
+	// [0, 1) . 上位 24 bit だけ使えば 1.0f に丸まらない
+	float nextFloat() { return ( next() >> 8 ) * ( 1.0f / 16777216.0f ); }
+
+private:
+	uint64_t state;
+	uint64_t inc;
+};
+
+// 64 bit を混ぜる (splitmix64 の最後の部分)
+inline uint64_t hash64( uint64_t x ) {
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+	return x;
+}
+
+// スレッドごとの乱数. seedRandom されるまではスレッドの生成順で系列を分けておく
+inline PCG32& getRandomEngine() {
+	static std::atomic<uint64_t> threadCount( 0 );
+	static thread_local PCG32 engine( hash64( 0 ), threadCount++ );
+	return engine;
+}
+
+// 同じ (画素, サンプル番号) なら何スレッドで回しても同じ系列になる
+inline void seedRandom( uint32_t pixel, uint32_t sample ) {
+	getRandomEngine().seed( hash64( ( (uint64_t)sample << 32 ) | pixel ), pixel );
+}
+
 inline float randf() {
-	return dist(engine);
+	return getRandomEngine().nextFloat();
 }
 inline float randf( float max ) {
 	return randf() * max;
@@ -55,11 +107,10 @@ inline float randf(float min, float max) {
 	return randf(max - min) + min;
 }
 inline int randi(int n) {
-	auto dist = std::uniform_int_distribution<int>(0, n - 1);
-	return dist( engine );
+	return (int)( ( (uint64_t)getRandomEngine().next() * (uint32_t)n ) >> 32 );
 }
 template <class T> const T& randSelect(const std::vector<T>& v) {
-	return v[randi(v.size())];
+	return v[randi((int)v.size())];
 }
 
 
@@ -3,44 +3,7 @@
 #include "Scene.h"
 #include "Material.h"
 
-std::optional<float> AABB::getIntersection( const Ray &ray ) {
-
-	const auto &o = ray.o;
-	const auto &d = ray.d;
-
-	if ( inRange( o.x, min.x, max.x ) && inRange( o.y, min.y, max.y ) && inRange( o.z, min.z, max.z ) ) { return true; }
-
-	float x = d.x > 0.0f ? min.x : max.x;
-	float y = d.y > 0.0f ? min.y : max.y;
-	float z = d.z > 0.0f ? min.z : max.z;
-
-	float validX = fabs( d.x ) > 0.00001f;
-	float validY = fabs( d.y ) > 0.00001f;
-	float validZ = fabs( d.z ) > 0.00001f;
-
-	float tx = validX ? ( x - o.x ) / d.x : 0.0f;
-	float ty = validY ? ( y - o.y ) / d.y : 0.0f;
-	float tz = validZ ? ( z - o.z ) / d.z : 0.0f;
-
-	Vector3 px = o + tx * d;
-	Vector3 py = o + ty * d;
-	Vector3 pz = o + tz * d;
-
-	if ( validX && tx >= 0.0f && inRange( px.y, min.y, max.y ) && inRange( px.z, min.z, max.z ) ) {
-		return tx;
-	}
-	if ( validY && ty >= 0.0f && inRange( py.z, min.z, max.z ) && inRange( py.x, min.x, max.x ) ) {
-		return ty;
-	}
-	if ( validZ && tz >= 0.0f && inRange( pz.x, min.x, max.x ) && inRange( pz.y, min.y, max.y ) ) {
-		return tz;
-	}
-
-	return std::nullopt;
-}
-
-
-std::optional<Intersection> Sphere::getIntersection( const Ray &ray ) {
+bool Sphere::intersect( const Ray &ray, const PrecomputedRay &precomputedRay, Hit *hit ) const {
 
 	float A = ray.d.lengthSq();
 	float B = dot( ray.d, ray.o - center );
@@ -48,22 +11,28 @@ std::optional<Intersection> Sphere::getIntersection( const Ray &ray ) {
 
 	float discriminant = B * B - A * C;
 	if ( discriminant < 0.0f ) {
-		return std::nullopt;
+		return false;
 	}
 
-	bool back = false;
 	float t = ( -B - sqrtf( discriminant ) ) / A;
 	if ( t < 0.0f ) {
 		t = ( -B + sqrtf( discriminant ) ) / A;
 		if ( t < 0.0f ) {
-			return std::nullopt;
+			return false;
 		}
-		back = true;
 	}
+	if ( t >= hit->t ) { return false; }
 
+	hit->t = t;
+	hit->object = this;
+	hit->instance = nullptr;
+	return true;
+}
+
+Intersection Sphere::createIntersection( const Ray &ray, const Hit &hit ) const {
 	Intersection result;
-	result.p = ray.o + t * ray.d;
-	result.t = t;
+	result.p = ray.o + hit.t * ray.d;
+	result.t = hit.t;
 	result.n = ( result.p - center ).normalize();
 	result.material = material;
 	result.i = -ray.d;
@@ -71,63 +40,177 @@ std::optional<Intersection> Sphere::getIntersection( const Ray &ray ) {
 
 	result.uv = Vector2((result.n.x+1)/2, (result.n.y+1)/2);
 
-	return std::move( result );
+	return result;
+}
+
+PointOnSurface Sphere::samplePoint( const Vector2 &u ) const {
+	const float z = 1.0f - 2.0f * u.x;
+	const float r = sqrtf( max( 0.0f, 1.0f - z * z ) );
+	const float phi = 2.0f * PI * u.y;
+	PointOnSurface point;
+	point.n = Vector3( r * cosf( phi ), r * sinf( phi ), z );
+	point.p = center + radius * point.n;
+	return point;
 }
 
 Vector3 Sphere::getRadiance( const Vector3 &p, const Vector3 &o ) const {
 	return material->getEmission();
 }
 
-std::optional<Intersection> Triangle::getIntersection( const Ray &ray ) {
-	auto &o = ray.o;
-	auto &d = ray.d;
-	auto &p0 = v[0].p;
-	auto &p1 = v[1].p;
-	auto &p2 = v[2].p;
-
-
-	auto v01 = p1 - p0;
-	auto v02 = p2 - p0;
-	auto v12 = p2 - p1;
+namespace {
+
+// 水密な交差判定 (Woop et al. 2013). hit には t と p1, p2 の重心座標だけ入れる
+inline bool intersectTriangle( const Vector3 &p0, const Vector3 &p1, const Vector3 &p2, const PrecomputedRay &r, Hit *hit ) {
+	const int kx = r.kx, ky = r.ky, kz = r.kz;
+
+	const Vector3 A = p0 - r.o;
+	const Vector3 B = p1 - r.o;
+	const Vector3 C = p2 - r.o;
+
+	// レイが原点から +z に伸びる空間に剪断
+	const float Ax = A[kx] - r.Sx * A[kz];
+	const float Ay = A[ky] - r.Sy * A[kz];
+	const float Bx = B[kx] - r.Sx * B[kz];
+	const float By = B[ky] - r.Sy * B[kz];
+	const float Cx = C[kx] - r.Sx * C[kz];
+	const float Cy = C[ky] - r.Sy * C[kz];
+
+	float U = Cx * By - Cy * Bx;
+	float V = Ax * Cy - Ay * Cx;
+	float W = Bx * Ay - By * Ax;
+
+	// 辺の上ぴったりのときは double で計算し直して, 隣の三角形と判定を食い違わせない
+	if ( U == 0.0f || V == 0.0f || W == 0.0f ) {
+		U = (float)( (double)Cx * By - (double)Cy * Bx );
+		V = (float)( (double)Ax * Cy - (double)Ay * Cx );
+		W = (float)( (double)Bx * Ay - (double)By * Ax );
+	}
 
-	auto n = cross( v01, v02 ).normalize();
-	if ( dot( n, d ) > 0.0f ) { n *= -1.0f; }
+	if ( ( U < 0.0f || V < 0.0f || W < 0.0f ) && ( U > 0.0f || V > 0.0f || W > 0.0f ) ) { return false; }
 
-	float d_dot_n = dot( d, n );
-	if ( fabs( d_dot_n ) < 0.0000001f ) { return std::nullopt; }
+	const float det = U + V + W;
+	if ( det == 0.0f ) { return false; }
 
-	float t = dot( p0 - o, n ) / d_dot_n;
+	const float Az = r.Sz * A[kz];
+	const float Bz = r.Sz * B[kz];
+	const float Cz = r.Sz * C[kz];
+	const float T = U * Az + V * Bz + W * Cz;
 
-	if ( t < 0.0f ) { return std::nullopt; }
+	// t = T / det が [0, hit->t) に入るかを割り算せずに見る
+	const float tMax = hit->t;
+	if ( det < 0.0f ? ( T > 0.0f || T <= tMax * det ) : ( T < 0.0f || T >= tMax * det ) ) { return false; }
 
-	auto p = o + t * d;
+	const float invDet = 1.0f / det;
+	hit->t = T * invDet;
+	hit->b1 = V * invDet;
+	hit->b2 = W * invDet;
+	return true;
+}
 
-	const auto vop0 = p0 - o;
-	const auto vop1 = p1 - o;
-	const auto vop2 = p2 - o;
+};
 
-	float V0 = dot( p - o, cross( vop1, vop2 ) );
-	float V1 = dot( p - o, cross( vop2, vop0 ) );
-	float V2 = dot( p - o, cross( vop0, vop1 ) );
-	float V = V0 + V1 + V2;
-	float a = V0 / V;
-	float b = V1 / V;
-	float c = V2 / V;
+bool Triangle::intersect( const Ray &ray, const PrecomputedRay &precomputedRay, Hit *hit ) const {
+	if ( !intersectTriangle( v[0].p, v[1].p, v[2].p, precomputedRay, hit ) ) { return false; }
+	hit->object = this;
+	hit->instance = nullptr;
+	return true;
+}
 
-	if ( !inRange01( a ) || !inRange01( b ) || !inRange01( c ) ) { return std::nullopt; }
+Intersection Triangle::createIntersection( const Ray &ray, const Hit &hit ) const {
+	const float b1 = hit.b1, b2 = hit.b2;
+	const float b0 = 1.0f - b1 - b2;
 
 	Intersection result;
-	result.p = std::move( p );
-	result.t = t;
-	result.n = ( a * v[0].n + b * v[1].n + c * v[2].n ).normalize();
-	result.uv = a * v[0].texCoord + b * v[1].texCoord + c * v[2].texCoord;
+	result.p = b0 * v[0].p + b1 * v[1].p + b2 * v[2].p;
+	result.t = hit.t;
+	result.n = ( b0 * v[0].n + b1 * v[1].n + b2 * v[2].n ).normalize();
+	result.uv = b0 * v[0].texCoord + b1 * v[1].texCoord + b2 * v[2].texCoord;
 	result.i = -ray.d;
 	result.material = material;
 	result.object = shared_from_this();
 
-	return std::move( result );
+	return result;
+}
+
+PointOnSurface Triangle::samplePoint( const Vector2 &u ) const {
+	const float su = sqrtf( u.x );
+	PointOnSurface point;
+	point.p = ( 1.0f - su ) * v[0].p + su * ( 1.0f - u.y ) * v[1].p + su * u.y * v[2].p;
+	point.n = cross( v[1].p - v[0].p, v[2].p - v[0].p ).normalize();
+	return point;
 }
 
 Vector3 Triangle::getRadiance( const Vector3 &p, const Vector3 &o ) const {
 	return material->getEmission();
 }
+
+bool TriangleMesh::intersect( uint32_t triangle, const PrecomputedRay &precomputedRay, Hit *hit ) const {
+	const uint32_t *index = &indices[triangle * 3];
+	if ( !intersectTriangle( positions[index[0]], positions[index[1]], positions[index[2]], precomputedRay, hit ) ) { return false; }
+	hit->object = nullptr;
+	hit->instance = nullptr;
+	hit->triangle = triangle;
+	return true;
+}
+
+Intersection TriangleMesh::createIntersection( const Ray &ray, const Hit &hit ) const {
+	const uint32_t *index = &indices[hit.triangle * 3];
+	const float b1 = hit.b1, b2 = hit.b2;
+	const float b0 = 1.0f - b1 - b2;
+
+	const Vector3 &p0 = positions[index[0]], &p1 = positions[index[1]], &p2 = positions[index[2]];
+	const Vector3 &n0 = normals[index[0]], &n1 = normals[index[1]], &n2 = normals[index[2]];
+
+	Intersection result;
+	result.p = b0 * p0 + b1 * p1 + b2 * p2;
+	result.t = hit.t;
+	// 法線が 0 の頂点 (OBJ に vn が無かった角) があれば面の法線にする. 向きは Triangle::calcNormal と同じ
+	if ( n0.lengthSq() == 0.0f || n1.lengthSq() == 0.0f || n2.lengthSq() == 0.0f ) {
+		result.n = cross( p1 - p0, p2 - p1 ).normalize();
+	} else {
+		result.n = ( b0 * n0 + b1 * n1 + b2 * n2 ).normalize();
+	}
+	result.uv = b0 * texCoords[index[0]] + b1 * texCoords[index[1]] + b2 * texCoords[index[2]];
+	result.i = -ray.d;
+	result.material = materials[materialIds[hit.triangle]];
+	result.object = nullptr;
+
+	return result;
+}
+
+void TriangleMesh::reorder( const std::vector<uint32_t> &order ) {
+	assert( order.size() == getTriangleCount() );
+
+	const uint32_t none = std::numeric_limits<uint32_t>::max();
+	std::vector<uint32_t> newVertex( positions.size(), none );
+	std::vector<uint32_t> newIndices( indices.size() );
+	std::vector<uint32_t> newMaterialIds( materialIds.size() );
+	uint32_t vertexCount = 0;
+	for ( size_t i = 0; i < order.size(); i++ ) {
+		for ( int k = 0; k < 3; k++ ) {
+			uint32_t &v = newVertex[indices[order[i] * 3 + k]];
+			if ( v == none ) { v = vertexCount++; }
+			newIndices[i * 3 + k] = v;
+		}
+		newMaterialIds[i] = materialIds[order[i]];
+	}
+
+	// どの三角形にも使われていない頂点は後ろに回す
+	for ( auto &v : newVertex ) {
+		if ( v == none ) { v = vertexCount++; }
+	}
+	std::vector<Vector3> newPositions( positions.size() );
+	std::vector<Vector3> newNormals( normals.size() );
+	std::vector<Vector2> newTexCoords( texCoords.size() );
+	for ( size_t v = 0; v < positions.size(); v++ ) {
+		newPositions[newVertex[v]] = positions[v];
+		newNormals[newVertex[v]] = normals[v];
+		newTexCoords[newVertex[v]] = texCoords[v];
+	}
+
+	positions.swap( newPositions );
+	normals.swap( newNormals );
+	texCoords.swap( newTexCoords );
+	indices.swap( newIndices );
+	materialIds.swap( newMaterialIds );
+}
@@ -14,6 +14,31 @@ struct Sample{
 	std::function<U> pdf;
 };
 
+// 3x3 の線形部分 (行ごと) + 平行移動
+struct AffineTransform {
+	Vector3 row[3];
+	Vector3 translation;
+
+	Vector3 transformPoint( const Vector3 &p ) const { return transformVector( p ) + translation; }
+	Vector3 transformVector( const Vector3 &v ) const { return Vector3( dot( row[0], v ), dot( row[1], v ), dot( row[2], v ) ); }
+	// 線形部分の転置を掛ける. 逆変換に対して使うと法線の変換になる
+	Vector3 transformTransposed( const Vector3 &v ) const { return row[0] * v.x + row[1] * v.y + row[2] * v.z; }
+
+	AffineTransform inverse() const {
+		// 逆行列の列は余因子 (行同士の外積) を行列式で割ったもの
+		Vector3 c0 = cross( row[1], row[2] );
+		Vector3 c1 = cross( row[2], row[0] );
+		Vector3 c2 = cross( row[0], row[1] );
+		float invDet = 1.0f / dot( row[0], c0 );
+		AffineTransform inv;
+		inv.row[0] = Vector3( c0.x, c1.x, c2.x ) * invDet;
+		inv.row[1] = Vector3( c0.y, c1.y, c2.y ) * invDet;
+		inv.row[2] = Vector3( c0.z, c1.z, c2.z ) * invDet;
+		inv.translation = -inv.transformVector( translation );
+		return inv;
+	}
+};
+
 struct Transform {
 	Vector3 position;
 	Vector3 scale;
@@ -23,15 +48,79 @@ struct Transform {
 	Transform( const Vector3 &position, const Vector3 &scale, const Quaternion &rotation ) :
 		position( position ), scale( scale ), rotation( rotation ) {}
 
+	// 回転 -> スケール -> 平行移動 の順に掛ける
+	AffineTransform toAffineTransform() const {
+		Vector3 ex = rotation * Vector3( 1, 0, 0 );
+		Vector3 ey = rotation * Vector3( 0, 1, 0 );
+		Vector3 ez = rotation * Vector3( 0, 0, 1 );
+		AffineTransform m;
+		m.row[0] = Vector3( ex.x, ey.x, ez.x ) * scale.x;
+		m.row[1] = Vector3( ex.y, ey.y, ez.y ) * scale.y;
+		m.row[2] = Vector3( ex.z, ey.z, ez.z ) * scale.z;
+		m.translation = position;
+		return m;
+	}
+};
+
+// 入れ子になった媒質. 何重にも入ることはないので固定長で持つ
+// null は媒質を持たない物体の中にいることを表す
+struct MediaStack {
+	static const int capacity = 8;
+
+	bool empty() const { return size == 0; }
+	ParticipatingMedia* top() const { return size > capacity ? overflow.back() : media[size - 1]; }
+	void push( ParticipatingMedia *m ) {
+		if ( size < capacity ) {
+			media[size] = m;
+		} else {
+			// 入れ子が深すぎるときだけヒープに積む
+			overflow.push_back( m );
+		}
+		size++;
+	}
+	void pop() {
+		if ( size > capacity ) { overflow.pop_back(); }
+		--size;
+	}
+
+private:
+	ParticipatingMedia *media[capacity];
+	std::vector<ParticipatingMedia*> overflow;
+	int size = 0;
 };
 
 struct Ray {
 	Vector3 o;
 	Vector3 d;
-	std::optional<Vector3> radiance;
 	int depth;
 
-	std::stack<std::shared_ptr<ParticipatingMedia>> media;
+	MediaStack media;
+};
+
+// 箱や三角形との交差判定用にレイごとに一回だけ計算しておくもの
+struct PrecomputedRay {
+	Vector3 o;
+	Vector3 invD;
+	int sign[3]; // 方向が負なら 1
+
+	// 三角形用. 方向の絶対値が最大の軸を kz にして, レイが +z を向くように剪断する
+	int kx, ky, kz;
+	float Sx, Sy, Sz;
+
+	PrecomputedRay( const Ray &ray ) : o( ray.o ), invD( 1.0f / ray.d.x, 1.0f / ray.d.y, 1.0f / ray.d.z ) {
+		sign[0] = invD.x < 0.0f;
+		sign[1] = invD.y < 0.0f;
+		sign[2] = invD.z < 0.0f;
+
+		const Vector3 absD( fabsf( ray.d.x ), fabsf( ray.d.y ), fabsf( ray.d.z ) );
+		kz = absD.x > absD.y ? ( absD.x > absD.z ? 0 : 2 ) : ( absD.y > absD.z ? 1 : 2 );
+		kx = ( kz + 1 ) % 3;
+		ky = ( kx + 1 ) % 3;
+		if ( ray.d[kz] < 0.0f ) { std::swap( kx, ky ); } // 面の向きを保つ
+		Sx = ray.d[kx] / ray.d[kz];
+		Sy = ray.d[ky] / ray.d[kz];
+		Sz = 1.0f / ray.d[kz];
+	}
 };
 
 struct Intersection {
@@ -44,6 +133,17 @@ struct Intersection {
 	std::shared_ptr<const PrimitiveObject> object;
 };
 
+// 走査中に覚えておく一番近い交差. Intersection は最後に一回だけ作る
+struct Hit {
+	float t = std::numeric_limits<float>::infinity();
+	float b1 = 0.0f, b2 = 0.0f;                 // 三角形の重心座標
+	const PrimitiveObject *object = nullptr;    // 当たったプリミティブ. TriangleMesh の三角形なら null
+	const PrimitiveObject *instance = nullptr;  // インスタンス越しに当たったときはそのインスタンス
+	uint32_t triangle = 0;                      // TriangleMesh の三角形に当たったときはその番号
+
+	Intersection getIntersection( const Ray &ray ) const;
+};
+
 struct PointOnSurface {
 	Vector3 p;
 	Vector3 n;
@@ -57,14 +157,38 @@ struct AABB {
 	Vector3 min;
 	Vector3 max;
 
-	AABB operator|( const AABB& aabb ) {
+	AABB operator|( const AABB& aabb ) const {
 		return AABB{ ::min( min, aabb.min ), ::max( max, aabb.max ) };
 	}
 	AABB& operator|=( const AABB& aabb ) {
 		return *this = *this | aabb;
 	}
 
-	std::optional<float> getIntersection( const Ray &ray );
+	Vector3 center() const { return ( min + max ) * 0.5f; }
+	float surfaceArea() const {
+		auto size = max - min;
+		return 2.0f * ( size.x * size.y + size.y * size.z + size.z * size.x );
+	}
+
+	const Vector3& operator[]( int i ) const { return i == 0 ? min : max; }
+
+	// 丸め誤差で境界上の交差を落とさないよう tFar を少しだけ広げる
+	static constexpr float farScale = 1.0f + 2.0f * 3.0f * ( FLT_EPSILON * 0.5f ) / ( 1.0f - 3.0f * ( FLT_EPSILON * 0.5f ) );
+
+	// スラブ法. [tMin, tMax] と重なる区間 [tNear, tFar] があれば true
+	bool getIntersection( const PrecomputedRay &ray, float tMin, float tMax, float *tNear, float *tFar ) const {
+
+		float txNear = ( ( *this )[ray.sign[0]].x - ray.o.x ) * ray.invD.x;
+		float txFar = ( ( *this )[1 - ray.sign[0]].x - ray.o.x ) * ray.invD.x;
+		float tyNear = ( ( *this )[ray.sign[1]].y - ray.o.y ) * ray.invD.y;
+		float tyFar = ( ( *this )[1 - ray.sign[1]].y - ray.o.y ) * ray.invD.y;
+		float tzNear = ( ( *this )[ray.sign[2]].z - ray.o.z ) * ray.invD.z;
+		float tzFar = ( ( *this )[1 - ray.sign[2]].z - ray.o.z ) * ray.invD.z;
+
+		*tNear = ::max( ::max( txNear, tyNear ), ::max( tzNear, tMin ) );
+		*tFar = ::min( ::min( ::min( txFar, tyFar ), tzFar ) * farScale, tMax );
+		return *tNear <= *tFar;
+	}
 };
 
 struct Object {
@@ -75,11 +199,36 @@ struct Object {
 struct PrimitiveObject : public Object, public std::enable_shared_from_this<PrimitiveObject> {
 	PrimitiveObject( std::shared_ptr<Material> material = nullptr ) : material( material ) {}
 
-	virtual std::optional<Intersection> getIntersection( const Ray &ray ) = 0;
+	std::optional<Intersection> getIntersection( const Ray &ray ) const {
+		Hit hit;
+		if ( !intersect( ray, PrecomputedRay( ray ), &hit ) ) { return std::nullopt; }
+		return hit.getIntersection( ray );
+	}
+
+	// hit->t より手前で当たったら hit を書き換えて true. 法線などはまだ作らない
+	virtual bool intersect( const Ray &ray, const PrecomputedRay &precomputedRay, Hit *hit ) const = 0;
+	// intersect で見つけた交差から Intersection を作る
+	virtual Intersection createIntersection( const Ray &ray, const Hit &hit ) const = 0;
+	// tMax より手前で当たるかだけ. 影レイ用
+	virtual bool occluded( const Ray &ray, const PrecomputedRay &precomputedRay, float tMax ) const {
+		Hit hit;
+		hit.t = tMax;
+		return intersect( ray, precomputedRay, &hit );
+	}
+
+	// 光源として点を選ぶとき用. 表面上で面積一様に選ぶ. 面積 0 なら光源サンプリングに使えない
+	virtual float getArea() const { return 0.0f; }
+	virtual PointOnSurface samplePoint( const Vector2 &u ) const { return PointOnSurface(); }
+	// 表面の法線がすべて収まる円錐 (軸と半頂角の cos). 光源の BVH で使う. 既定は全方向
+	virtual void getNormalBounds( Vector3 *axis, float *cosTheta ) const { *axis = Vector3( 0.0f, 0.0f, 1.0f ); *cosTheta = -1.0f; }
 
 	std::shared_ptr<Material> material;
 };
 
+inline Intersection Hit::getIntersection( const Ray &ray ) const {
+	return ( instance != nullptr ? instance : object )->createIntersection( ray, *this );
+}
+
 inline AABB getAABB( const spvector<Object>::const_iterator &begin, const spvector<Object>::const_iterator &end ) {
 	AABB aabb = ( *begin )->getAABB();
 	for ( auto it = begin + 1; it != end; it++ ) {
@@ -108,10 +257,13 @@ struct Sphere : public PrimitiveObject {
 	Sphere( const Vector3 &center, float radius, std::shared_ptr<Material> material ) : PrimitiveObject( material ), center( center ), radius( radius ) {}
 	Vector3 center;
 	float radius;
-	virtual std::optional<Intersection> getIntersection( const Ray &ray );
+	virtual bool intersect( const Ray &ray, const PrecomputedRay &precomputedRay, Hit *hit ) const;
+	virtual Intersection createIntersection( const Ray &ray, const Hit &hit ) const;
 	virtual AABB getAABB() {
 		return AABB{ center - Vector3( radius ), center + Vector3( radius ) };
 	}
+	virtual float getArea() const { return 4.0f * PI * radius * radius; }
+	virtual PointOnSurface samplePoint( const Vector2 &u ) const;
 
 	virtual Vector3 getRadiance( const Vector3 &p, const Vector3 &o) const;
 };
@@ -125,12 +277,17 @@ struct Vertex {
 
 struct Triangle : public PrimitiveObject {
 	Vertex v[3];
-	virtual std::optional<Intersection> getIntersection( const Ray &ray );
+	// 水密な交差判定 (Woop et al. 2013). hit には t と v[1], v[2] の重心座標だけ入れる
+	virtual bool intersect( const Ray &ray, const PrecomputedRay &precomputedRay, Hit *hit ) const;
+	virtual Intersection createIntersection( const Ray &ray, const Hit &hit ) const;
 	virtual AABB getAABB() { return AABB{ min( v[0].p,v[1].p,v[2].p ),max( v[0].p,v[1].p,v[2].p ) }; }
+	virtual float getArea() const { return 0.5f * cross( v[1].p - v[0].p, v[2].p - v[0].p ).length(); }
+	virtual PointOnSurface samplePoint( const Vector2 &u ) const;
+	virtual void getNormalBounds( Vector3 *axis, float *cosTheta ) const { *axis = cross( v[1].p - v[0].p, v[2].p - v[0].p ).normalized(); *cosTheta = 1.0f; }
 
 	void calcNormal() {
-		// _ʒu Vertex  n vZ
-		// bV񂩂 n ͂ȂƂp
+		// 頂点位置から Vertex の n を計算
+		// メッシュ情報から n を入力しないとき用
 		Vector3 n = cross( v[1].p - v[0].p, v[2].p - v[1].p ).normalize();
 		v[0].n = n;
 		v[1].n = n;
@@ -139,4 +296,36 @@ struct Triangle : public PrimitiveObject {
 
 	virtual Vector3 getRadiance( const Vector3 &p, const Vector3 &o ) const;
 
-};
\ No newline at end of file
+};
+
+// メッシュの三角形をまとめて持つ. 頂点は三角形同士で共有して, 三角形は番号で指す
+// Triangle のように三角形ごとにオブジェクトを作らないので, 1 つあたり添字 3 つとマテリアルの番号で済む
+struct TriangleMesh {
+	std::vector<Vector3> positions;
+	std::vector<Vector3> normals;      // 0 なら面の法線を使う
+	std::vector<Vector2> texCoords;
+	std::vector<uint32_t> indices;     // 三角形ごとに頂点番号 3 つ
+	std::vector<uint32_t> materialIds; // 三角形ごとに materials の番号
+	spvector<Material> materials;
+
+	uint32_t getTriangleCount() const { return (uint32_t)materialIds.size(); }
+	const Vector3& getPosition( uint32_t triangle, int k ) const { return positions[indices[triangle * 3 + k]]; }
+	AABB getAABB( uint32_t triangle ) const {
+		const Vector3 &p0 = getPosition( triangle, 0 ), &p1 = getPosition( triangle, 1 ), &p2 = getPosition( triangle, 2 );
+		return AABB{ min( p0, p1, p2 ), max( p0, p1, p2 ) };
+	}
+
+	// Triangle::intersect と同じ判定. hit には番号を入れて, object と instance は null にする
+	bool intersect( uint32_t triangle, const PrecomputedRay &precomputedRay, Hit *hit ) const;
+	bool occluded( uint32_t triangle, const PrecomputedRay &precomputedRay, float tMax ) const {
+		Hit hit;
+		hit.t = tMax;
+		return intersect( triangle, precomputedRay, &hit );
+	}
+	// object は null のまま返すので, 呼んだ側 (MeshInstance) が入れる
+	Intersection createIntersection( const Ray &ray, const Hit &hit ) const;
+
+	// 三角形を order の順 (order[i] 番目を i 番目に) に並べ替える. BVH の葉の中の三角形がメモリ上で隣り合うように
+	// 頂点も新しい順で最初に使われる順に並べ直す
+	void reorder( const std::vector<uint32_t> &order );
+};
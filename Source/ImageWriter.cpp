@@ -0,0 +1,87 @@
+#include "ImageWriter.h"
+
+#include <chrono>
+
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#pragma warning(push)
+#pragma warning(disable : 4996)
+#include "3rdparty/stb/stb_image_write.h"
+#pragma warning(pop)
+
+ImageWriter::ImageWriter( int width, int height, float ( *toneMap )( float ) ) : width( width ), height( height ), toneMap( toneMap ), thread( &ImageWriter::run, this ) {
+}
+
+ImageWriter::~ImageWriter() {
+	{
+		std::lock_guard<std::mutex> lock( mutex );
+		quit = true;
+	}
+	condition.notify_all();
+	thread.join();
+}
+
+void ImageWriter::submit( std::vector<Vector3> &image, const std::string &filename ) {
+	assert( (int)image.size() == width * height );
+	{
+		std::lock_guard<std::mutex> lock( mutex );
+		pending.push_back( Job{ std::move( image ), filename } );
+		if ( !freeImages.empty() ) {
+			image = std::move( freeImages.back() );
+			freeImages.pop_back();
+		} else {
+			image = std::vector<Vector3>();
+		}
+	}
+	condition.notify_all();
+
+	// 書き終わったバッファが無ければ新しく確保する
+	image.resize( width * height );
+}
+
+void ImageWriter::flush() {
+	std::unique_lock<std::mutex> lock( mutex );
+	condition.wait( lock, [this] { return pending.empty() && !writing; } );
+}
+
+double ImageWriter::getLastWriteSeconds() {
+	std::lock_guard<std::mutex> lock( mutex );
+	return lastWriteSeconds;
+}
+
+void ImageWriter::run() {
+	Job job;
+	std::vector<uint8_t> result( width * height * 3 );
+
+	while ( true ) {
+		{
+			std::unique_lock<std::mutex> lock( mutex );
+			condition.wait( lock, [this] { return !pending.empty() || quit; } );
+			// 終わるときも待ちがあれば先に書く
+			if ( pending.empty() ) { return; }
+			job = std::move( pending.front() );
+			pending.pop_front();
+			writing = true;
+		}
+		const auto start = std::chrono::steady_clock::now();
+
+		for ( int i = 0; i < width * height; i++ ) {
+			const Vector3 &radiance = job.image[i];
+			result[i * 3 + 0] = (uint8_t)( toneMap( radiance.x ) * 255 );
+			result[i * 3 + 1] = (uint8_t)( toneMap( radiance.y ) * 255 );
+			result[i * 3 + 2] = (uint8_t)( toneMap( radiance.z ) * 255 );
+		}
+		if ( !stbi_write_png( job.filename.c_str(), width, height, 3, result.data(), width * 3 ) ) {
+			fprintf( stderr, "Cannot write image %s\n", job.filename.c_str() );
+		}
+
+		const double seconds = std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+
+		{
+			std::lock_guard<std::mutex> lock( mutex );
+			writing = false;
+			lastWriteSeconds = seconds;
+			freeImages.push_back( std::move( job.image ) );
+		}
+		condition.notify_all();
+	}
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "General.h"
+
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+
+// 途中経過の画像を, レンダリングとは別のスレッドでトーンマップして PNG に書き出す
+// 番号つきで別のファイルになるので, 書き出しが追いつかなくても捨てずに順番に書く
+class ImageWriter {
+public:
+	ImageWriter( int width, int height, float ( *toneMap )( float ) );
+	~ImageWriter();
+
+	// image のバッファごと渡すのでコピーしない
+	// image には書き終わったバッファが戻ってくるので (無ければ新しく確保する), 次もそのまま埋めて使う
+	void submit( std::vector<Vector3> &image, const std::string &filename );
+	// 渡した画像を全部書き終わるまで待つ
+	void flush();
+	// 直前の 1 枚のトーンマップと書き出しにかかった時間. まだ書いていなければ負
+	double getLastWriteSeconds();
+
+private:
+	void run();
+
+	int width;
+	int height;
+	float ( *toneMap )( float );
+
+	std::mutex mutex;
+	std::condition_variable condition;
+	struct Job {
+		std::vector<Vector3> image;
+		std::string filename;
+	};
+	std::deque<Job> pending;
+	std::vector<std::vector<Vector3>> freeImages; // 書き終わったバッファ. submit で使い回す
+	bool writing = false;
+	bool quit = false;
+	double lastWriteSeconds = -1.0;
+
+	std::thread thread; // 他のメンバを初期化してから起動するので最後に置く
+};
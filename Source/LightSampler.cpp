@@ -0,0 +1,353 @@
+#include "LightSampler.h"
+#include "Material.h"
+
+namespace {
+
+const float OneMinusEpsilon = 1.0f - FLT_EPSILON * 0.5f;
+
+float luminance( const Vector3 &c ) {
+	return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z;
+}
+
+float safeSqrt( float x ) { return sqrtf( max( x, 0.0f ) ); }
+float safeAcos( float x ) { return acosf( clamp( x, -1.0f, 1.0f ) ); }
+
+// cos( max( 0, a - b ) ) と sin( max( 0, a - b ) ) を sin, cos だけで
+float cosSubClamped( float sinA, float cosA, float sinB, float cosB ) {
+	if ( cosA > cosB ) { return 1.0f; }
+	return cosA * cosB + sinA * sinB;
+}
+float sinSubClamped( float sinA, float cosA, float sinB, float cosB ) {
+	if ( cosA > cosB ) { return 0.0f; }
+	return sinA * cosB - cosA * sinB;
+}
+
+// axis 周りに theta 回す (Rodrigues)
+Vector3 rotate( const Vector3 &v, const Vector3 &axis, float theta ) {
+	const float c = cosf( theta );
+	const float s = sinf( theta );
+	return v * c + cross( axis, v ) * s + axis * ( dot( axis, v ) * ( 1.0f - c ) );
+}
+
+// 2 つの円錐を含む円錐. 光源は両面に光るので b は裏返して近い方で合わせる
+void unionCone( const Vector3 &wa, float cosA, Vector3 wb, float cosB, Vector3 *w, float *cosTheta ) {
+	*w = wa;
+	*cosTheta = -1.0f;
+	if ( cosA <= -1.0f || cosB <= -1.0f ) { return; }
+	if ( dot( wa, wb ) < 0.0f ) { wb = -wb; }
+
+	const float thetaA = safeAcos( cosA );
+	const float thetaB = safeAcos( cosB );
+	const float thetaD = safeAcos( dot( wa, wb ) );
+	if ( min( thetaD + thetaB, PI ) <= thetaA ) { *cosTheta = cosA; return; }
+	if ( min( thetaD + thetaA, PI ) <= thetaB ) { *w = wb; *cosTheta = cosB; return; }
+
+	const float thetaO = ( thetaA + thetaD + thetaB ) * 0.5f;
+	if ( thetaO >= PI ) { return; }
+	const Vector3 wr = cross( wa, wb );
+	if ( wr.lengthSq() == 0.0f ) { return; }
+	*w = rotate( wa, wr.normalized(), thetaO - thetaA ).normalize();
+	*cosTheta = cosf( thetaO );
+}
+
+LightBounds getLightBounds( const std::shared_ptr<PrimitiveObject> &light ) {
+	LightBounds bounds;
+	bounds.aabb = light->getAABB();
+	bounds.phi = max( luminance( light->material->getEmission() ), 0.0f ) * light->getArea() * PI;
+	light->getNormalBounds( &bounds.w, &bounds.cosTheta_o );
+	bounds.cosTheta_e = 0.0f; // 拡散光源なので法線から 90 度まで
+	return bounds;
+}
+
+// 向きの広がり. 放射しうる方向を cos で重み付けした立体角
+float orientationMeasure( const LightBounds &bounds ) {
+	const float thetaO = safeAcos( bounds.cosTheta_o );
+	const float thetaE = safeAcos( bounds.cosTheta_e );
+	const float thetaW = min( thetaO + thetaE, PI );
+	const float sinThetaO = safeSqrt( 1.0f - bounds.cosTheta_o * bounds.cosTheta_o );
+	return 2.0f * PI * ( 1.0f - bounds.cosTheta_o ) + PI * 0.5f * ( 2.0f * thetaW * sinThetaO - cosf( thetaO - 2.0f * thetaW ) - 2.0f * thetaO * sinThetaO + bounds.cosTheta_o );
+}
+
+float evalSplitCost( const LightBounds &bounds ) {
+	return bounds.phi * orientationMeasure( bounds ) * bounds.aabb.surfaceArea();
+}
+
+};
+
+int UniformLightSampler::sample( const Vector3 &p, const Vector3 &n, float u, float *pmf ) const {
+	if ( lightCount == 0 ) { return -1; }
+	*pmf = 1.0f / lightCount;
+	return min( (int)( u * lightCount ), lightCount - 1 );
+}
+
+AliasTable::AliasTable( const std::vector<float> &weights ) {
+	double sum = 0.0;
+	for ( float w : weights ) { sum += w; }
+	if ( sum <= 0.0 ) { return; }
+
+	const int n = (int)weights.size();
+	bins.resize( n );
+	std::vector<std::pair<int, double>> under, over;
+	for ( int i = 0; i < n; i++ ) {
+		bins[i].pmf = (float)( weights[i] / sum );
+		bins[i].q = 1.0f;
+		bins[i].alias = i;
+		const double scaled = weights[i] / sum * n;
+		( scaled < 1.0 ? under : over ).emplace_back( i, scaled );
+	}
+
+	// 足りない箱を余っている箱で埋める
+	while ( !under.empty() && !over.empty() ) {
+		const auto u = under.back();
+		const auto o = over.back();
+		under.pop_back();
+		over.pop_back();
+
+		bins[u.first].q = (float)u.second;
+		bins[u.first].alias = o.first;
+
+		const double excess = o.second - ( 1.0 - u.second );
+		( excess < 1.0 ? under : over ).emplace_back( o.first, excess );
+	}
+	// 残りは丸め誤差なので q = 1 のまま
+}
+
+int AliasTable::sample( float u, float *pmf ) const {
+	const int n = (int)bins.size();
+	const float x = u * n;
+	const int offset = min( (int)x, n - 1 );
+	const float up = min( x - offset, OneMinusEpsilon );
+	const int index = up < bins[offset].q ? offset : bins[offset].alias;
+	*pmf = bins[index].pmf;
+	return index;
+}
+
+PowerLightSampler::PowerLightSampler( const spvector<PrimitiveObject> &lights ) {
+	std::vector<float> weights;
+	weights.reserve( lights.size() );
+	for ( const auto &light : lights ) {
+		weights.push_back( getLightBounds( light ).phi );
+	}
+	aliasTable = AliasTable( weights );
+}
+
+int PowerLightSampler::sample( const Vector3 &p, const Vector3 &n, float u, float *pmf ) const {
+	if ( aliasTable.empty() ) { return -1; }
+	return aliasTable.sample( u, pmf );
+}
+
+float LightBounds::importance( const Vector3 &p, const Vector3 &n ) const {
+	const Vector3 pc = aabb.center();
+	const float radius = ( aabb.max - aabb.min ).length() * 0.5f;
+	Vector3 wi = p - pc;
+	const float distSq = wi.lengthSq();
+	if ( distSq > 0.0f ) { wi /= sqrtf( distSq ); }
+	// 光源の中や近くで発散しないように
+	const float d2 = max( distSq, radius );
+
+	const float cosThetaW = fabsf( dot( w, wi ) );
+	const float sinThetaW = safeSqrt( 1.0f - cosThetaW * cosThetaW );
+
+	// p から見たバウンディング球の広がり. 中にいたら全方向
+	const float cosThetaB = distSq < radius * radius ? -1.0f : safeSqrt( 1.0f - radius * radius / distSq );
+	const float sinThetaB = safeSqrt( 1.0f - cosThetaB * cosThetaB );
+
+	// max( 0, theta_w - theta_o - theta_b ) がありうる一番小さい放射角
+	const float sinThetaO = safeSqrt( 1.0f - cosTheta_o * cosTheta_o );
+	const float cosThetaX = cosSubClamped( sinThetaW, cosThetaW, sinThetaO, cosTheta_o );
+	const float sinThetaX = sinSubClamped( sinThetaW, cosThetaW, sinThetaO, cosTheta_o );
+	const float cosThetaP = cosSubClamped( sinThetaX, cosThetaX, sinThetaB, cosThetaB );
+	if ( cosThetaP <= cosTheta_e ) { return 0.0f; }
+
+	float result = phi * cosThetaP / d2;
+	if ( n.x != 0.0f || n.y != 0.0f || n.z != 0.0f ) {
+		// 透過もあるので両側を見る
+		const float cosThetaI = fabsf( dot( wi, n ) );
+		const float sinThetaI = safeSqrt( 1.0f - cosThetaI * cosThetaI );
+		result *= cosSubClamped( sinThetaI, cosThetaI, sinThetaB, cosThetaB );
+	}
+	return max( result, 0.0f );
+}
+
+LightBounds operator|( const LightBounds &a, const LightBounds &b ) {
+	if ( a.phi == 0.0f ) { return b; }
+	if ( b.phi == 0.0f ) { return a; }
+
+	LightBounds result;
+	result.aabb = a.aabb | b.aabb;
+	result.phi = a.phi + b.phi;
+	unionCone( a.w, a.cosTheta_o, b.w, b.cosTheta_o, &result.w, &result.cosTheta_o );
+	result.cosTheta_e = min( a.cosTheta_e, b.cosTheta_e );
+	return result;
+}
+
+BVHLightSampler::BVHLightSampler( const spvector<PrimitiveObject> &lights ) : lightBitTrails( lights.size(), 0 ), inTree( lights.size(), false ) {
+	std::vector<std::pair<int, LightBounds>> boundedLights;
+	for ( int i = 0; i < (int)lights.size(); i++ ) {
+		const auto bounds = getLightBounds( lights[i] );
+		if ( bounds.phi > 0.0f ) {
+			boundedLights.emplace_back( i, bounds );
+			inTree[i] = true;
+		}
+	}
+	if ( boundedLights.empty() ) { return; }
+
+	nodes.reserve( 2 * boundedLights.size() - 1 );
+	buildNode( boundedLights, 0, (int)boundedLights.size(), 0, 0 );
+}
+
+int BVHLightSampler::buildNode( std::vector<std::pair<int, LightBounds>> &lights, int begin, int end, uint64_t bitTrail, int depth ) {
+	const int nodeIndex = (int)nodes.size();
+	nodes.emplace_back();
+
+	if ( end - begin == 1 ) {
+		nodes[nodeIndex].bounds = lights[begin].second;
+		nodes[nodeIndex].secondChildOffset = -1;
+		nodes[nodeIndex].lightIndex = lights[begin].first;
+		lightBitTrails[lights[begin].first] = bitTrail;
+		return nodeIndex;
+	}
+
+	LightBounds bounds;
+	AABB centroidBounds{ lights[begin].second.aabb.center(), lights[begin].second.aabb.center() };
+	for ( int i = begin; i < end; i++ ) {
+		bounds = bounds | lights[i].second;
+		const Vector3 c = lights[i].second.aabb.center();
+		centroidBounds |= AABB{ c, c };
+	}
+	const Vector3 extent = bounds.aabb.max - bounds.aabb.min;
+	const float maxExtent = max( extent.x, max( extent.y, extent.z ) );
+	const Vector3 centroidExtent = centroidBounds.max - centroidBounds.min;
+
+	auto getBucket = [&]( const LightBounds &b, int axis ) {
+		const float t = ( b.aabb.center()[axis] - centroidBounds.min[axis] ) / centroidExtent[axis];
+		return clamp( (int)( t * bucketCount ), 0, bucketCount - 1 );
+	};
+
+	// 向きも入れた SAH (SAOH) で分割を選ぶ. 深くなりすぎたら個数で半分に
+	int mid = -1;
+	if ( depth < maxDepth / 2 ) {
+		float bestCost = std::numeric_limits<float>::infinity();
+		int bestAxis = -1;
+		int bestSplit = -1;
+		for ( int axis = 0; axis < 3; axis++ ) {
+			if ( centroidExtent[axis] <= 0.0f ) { continue; }
+
+			LightBounds buckets[bucketCount];
+			for ( int i = begin; i < end; i++ ) {
+				const int b = getBucket( lights[i].second, axis );
+				buckets[b] = buckets[b] | lights[i].second;
+			}
+
+			// 細長いノードを縦に切るのを避ける
+			const float kr = maxExtent / extent[axis];
+			for ( int split = 0; split < bucketCount - 1; split++ ) {
+				LightBounds left, right;
+				for ( int b = 0; b <= split; b++ ) { left = left | buckets[b]; }
+				for ( int b = split + 1; b < bucketCount; b++ ) { right = right | buckets[b]; }
+				if ( left.phi == 0.0f || right.phi == 0.0f ) { continue; }
+
+				const float cost = kr * ( evalSplitCost( left ) + evalSplitCost( right ) );
+				if ( cost < bestCost ) {
+					bestCost = cost;
+					bestAxis = axis;
+					bestSplit = split;
+				}
+			}
+		}
+
+		if ( bestAxis >= 0 ) {
+			auto it = std::partition( lights.begin() + begin, lights.begin() + end, [&]( const std::pair<int, LightBounds> &l ) {
+				return getBucket( l.second, bestAxis ) <= bestSplit;
+			} );
+			mid = (int)( it - lights.begin() );
+			if ( mid == begin || mid == end ) { mid = -1; }
+		}
+	}
+	if ( mid < 0 ) {
+		int axis = 0;
+		if ( centroidExtent.y > centroidExtent[axis] ) { axis = 1; }
+		if ( centroidExtent.z > centroidExtent[axis] ) { axis = 2; }
+		mid = ( begin + end ) / 2;
+		std::nth_element( lights.begin() + begin, lights.begin() + mid, lights.begin() + end, [axis]( const std::pair<int, LightBounds> &a, const std::pair<int, LightBounds> &b ) {
+			return a.second.aabb.center()[axis] < b.second.aabb.center()[axis];
+		} );
+	}
+
+	buildNode( lights, begin, mid, bitTrail, depth + 1 );
+	const int secondChild = buildNode( lights, mid, end, bitTrail | ( 1ull << depth ), depth + 1 );
+
+	nodes[nodeIndex].bounds = bounds;
+	nodes[nodeIndex].secondChildOffset = secondChild;
+	nodes[nodeIndex].lightIndex = -1;
+	return nodeIndex;
+}
+
+int BVHLightSampler::sample( const Vector3 &p, const Vector3 &n, float u, float *pmf ) const {
+	if ( nodes.empty() ) { return -1; }
+
+	int index = 0;
+	float prob = 1.0f;
+	while ( true ) {
+		const auto &node = nodes[index];
+		if ( node.lightIndex >= 0 ) {
+			// 根が葉のときだけはまだ見ていない
+			if ( index == 0 && node.bounds.importance( p, n ) <= 0.0f ) { return -1; }
+			*pmf = prob;
+			return node.lightIndex;
+		}
+
+		const float ci0 = nodes[index + 1].bounds.importance( p, n );
+		const float ci1 = nodes[node.secondChildOffset].bounds.importance( p, n );
+		if ( ci0 <= 0.0f && ci1 <= 0.0f ) { return -1; }
+
+		// u を使い回して子を選ぶ
+		const float p0 = ci0 / ( ci0 + ci1 );
+		if ( u < p0 ) {
+			u = min( u / p0, OneMinusEpsilon );
+			prob *= p0;
+			index = index + 1;
+		} else {
+			u = min( ( u - p0 ) / ( 1.0f - p0 ), OneMinusEpsilon );
+			prob *= 1.0f - p0;
+			index = node.secondChildOffset;
+		}
+	}
+}
+
+float BVHLightSampler::getPmf( const Vector3 &p, const Vector3 &n, int index ) const {
+	if ( index < 0 || index >= (int)inTree.size() || !inTree[index] ) { return 0.0f; }
+
+	uint64_t bitTrail = lightBitTrails[index];
+	int nodeIndex = 0;
+	float prob = 1.0f;
+	if ( nodes[0].lightIndex >= 0 ) {
+		return nodes[0].bounds.importance( p, n ) > 0.0f ? 1.0f : 0.0f;
+	}
+	while ( nodes[nodeIndex].lightIndex < 0 ) {
+		const auto &node = nodes[nodeIndex];
+		const float ci0 = nodes[nodeIndex + 1].bounds.importance( p, n );
+		const float ci1 = nodes[node.secondChildOffset].bounds.importance( p, n );
+		if ( ci0 <= 0.0f && ci1 <= 0.0f ) { return 0.0f; }
+
+		// sample と同じ計算にしておかないと MIS の重みがずれる
+		const float p0 = ci0 / ( ci0 + ci1 );
+		if ( bitTrail & 1 ) {
+			prob *= 1.0f - p0;
+			nodeIndex = node.secondChildOffset;
+		} else {
+			prob *= p0;
+			nodeIndex = nodeIndex + 1;
+		}
+		bitTrail >>= 1;
+	}
+	return prob;
+}
+
+std::shared_ptr<LightSampler> createLightSampler( LightSamplerType type, const spvector<PrimitiveObject> &lights ) {
+	switch ( type ) {
+	case LightSamplerType::Uniform: return std::make_shared<UniformLightSampler>( lights );
+	case LightSamplerType::Power: return std::make_shared<PowerLightSampler>( lights );
+	default: return std::make_shared<BVHLightSampler>( lights );
+	}
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+#include "General.h"
+#include "Geometry.h"
+
+enum class LightSamplerType {
+	Uniform, // 一様に選ぶ
+	Power,   // 放射束に比例して選ぶ
+	BVH,     // シェーディング点から見た寄与の見積もりで光源の木を辿る
+};
+
+// 明示的な光源のどれを選ぶかを決める. 光源は Scene に追加した順の番号で扱う
+// p, n はシェーディング点. n が 0 なら面の向きは見ない
+class LightSampler {
+public:
+	virtual ~LightSampler() {}
+
+	// 選んだ光源の番号と, それを選ぶ確率. 選べなければ -1
+	virtual int sample( const Vector3 &p, const Vector3 &n, float u, float *pmf ) const = 0;
+	virtual float getPmf( const Vector3 &p, const Vector3 &n, int index ) const = 0;
+};
+
+class UniformLightSampler : public LightSampler {
+public:
+	UniformLightSampler( const spvector<PrimitiveObject> &lights ) : lightCount( (int)lights.size() ) {}
+
+	virtual int sample( const Vector3 &p, const Vector3 &n, float u, float *pmf ) const;
+	virtual float getPmf( const Vector3 &p, const Vector3 &n, int index ) const { return lightCount > 0 ? 1.0f / lightCount : 0.0f; }
+
+private:
+	int lightCount;
+};
+
+// Walker の alias 法. 重みに比例した番号を O(1) で選ぶ
+class AliasTable {
+public:
+	AliasTable() {}
+	AliasTable( const std::vector<float> &weights );
+
+	int sample( float u, float *pmf ) const;
+	float getPmf( int index ) const { return bins[index].pmf; }
+	bool empty() const { return bins.empty(); }
+
+private:
+	struct Bin {
+		float q;   // この箱で自分を選ぶ確率
+		float pmf;
+		int alias;
+	};
+	std::vector<Bin> bins;
+};
+
+class PowerLightSampler : public LightSampler {
+public:
+	PowerLightSampler( const spvector<PrimitiveObject> &lights );
+
+	virtual int sample( const Vector3 &p, const Vector3 &n, float u, float *pmf ) const;
+	virtual float getPmf( const Vector3 &p, const Vector3 &n, int index ) const { return aliasTable.empty() ? 0.0f : aliasTable.getPmf( index ); }
+
+private:
+	AliasTable aliasTable;
+};
+
+// 光源の範囲と向きをまとめたもの (Conty Estevez & Kulla 2018)
+// 放射は法線 w から半頂角 theta_o の円錐に収まる向きの面から, さらに theta_e まで広がる
+// この renderer の光源は両面に光るので, 向きは w と -w の両方を見る
+struct LightBounds {
+	AABB aabb;
+	Vector3 w;
+	float phi = 0.0f; // 放射束
+	float cosTheta_o = 1.0f;
+	float cosTheta_e = 0.0f;
+
+	// p から見たときの寄与の見積もり. 下から抑えた角度で計算するので, 寄与がありうるなら 0 にはならない
+	float importance( const Vector3 &p, const Vector3 &n ) const;
+};
+
+LightBounds operator|( const LightBounds &a, const LightBounds &b );
+
+struct LightBVHNode {
+	LightBounds bounds;
+	int secondChildOffset; // 内部ノード. 1 つ目の子は直後に置く
+	int lightIndex;        // 葉. 内部ノードなら -1
+};
+
+class BVHLightSampler : public LightSampler {
+public:
+	BVHLightSampler( const spvector<PrimitiveObject> &lights );
+
+	virtual int sample( const Vector3 &p, const Vector3 &n, float u, float *pmf ) const;
+	virtual float getPmf( const Vector3 &p, const Vector3 &n, int index ) const;
+
+private:
+	static const int bucketCount = 12;
+	static const int maxDepth = 64;
+
+	int buildNode( std::vector<std::pair<int, LightBounds>> &lights, int begin, int end, uint64_t bitTrail, int depth );
+
+	std::vector<LightBVHNode> nodes;
+	// 根から葉までの分岐. i ビット目が 1 なら深さ i で 2 つ目の子へ進む
+	std::vector<uint64_t> lightBitTrails;
+	std::vector<bool> inTree; // 放射束が 0 の光源は木に入れない
+};
+
+std::shared_ptr<LightSampler> createLightSampler( LightSamplerType type, const spvector<PrimitiveObject> &lights );
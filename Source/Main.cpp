@@ -6,48 +6,47 @@
 #include <chrono>
 #include <omp.h>
 
-#define STB_IMAGE_WRITE_IMPLEMENTATION
-#pragma warning(push)
-#pragma warning(disable : 4996)
-#include "3rdparty/stb/stb_image_write.h"
-#pragma warning(pop)
-
 #include "Geometry.h"
 #include "Scene.h"
 #include "Material.h"
 #include "Mesh.h"
 #include "PathTracer.h"
-#include "Quaternion.h"
-#include "Texture.h"
-
-struct Camera {
-	Vector3 position;
-	Vector3 eye;
-	Vector3 up;
-	float horizontalFOV;
-	float aspect;
-
-	Ray getRay( float u, float v ) {
-		// u [-1, 1]
-		// v [-1, 1]
-
-		float verticalFOV = horizontalFOV * aspect;
-		Vector3 right = cross( eye, up );
-
-		Vector3 d = ( eye + u * tanf( horizontalFOV / 2.0f * ToRad ) * right + v * tanf( verticalFOV / 2.0f * ToRad ) * up ).normalize();
+#include "Sampler.h"
+#include "TileScheduler.h"
+#include "ImageWriter.h"
+#include "Stats.h"
+#include "Camera.h"
+#include "SceneLoader.h"
+
+// 画素ごとの和と, 輝度の平均と分散 (Welford)
+struct PixelStatistics {
+	Vector3 sum;
+	int count = 0;
+	float mean = 0.0f;
+	float m2 = 0.0f;
+
+	void add( const Vector3 &radiance ) {
+		sum += radiance;
+		count++;
+		const float l = 0.2126f * radiance.x + 0.7152f * radiance.y + 0.0722f * radiance.z;
+		const float delta = l - mean;
+		mean += delta / count;
+		m2 += delta * ( l - mean );
+	}
 
-		Ray ray;
-		ray.o = position;
-		ray.d = d;
-		ray.depth = 1;
+	Vector3 getRadiance() const { return count > 0 ? sum / (float)count : Vector3( 0.0f ); }
 
-		return std::move( ray );
+	// 平均の標準誤差をトーンマップ (sqrt) 後の値に直したもの. d sqrt(x) = dx / 2 sqrt(x)
+	float getError() const {
+		if ( count < 2 ) { return std::numeric_limits<float>::infinity(); }
+		const float variance = m2 / ( count - 1 );
+		return sqrtf( variance / count ) / ( 2.0f * sqrtf( max( mean, 1e-4f ) ) );
 	}
 };
 
 struct ToneMapping {
 	static float toneMap( float x ) {
-		// Ƃ肠K}␳
+		// とりあえずガンマ補正だけ
 		return powf( clamp01( x ), 1.0f / 2.0f );
 	}
 
@@ -55,167 +54,184 @@ struct ToneMapping {
 
 
 
-int main() {
+// Xalia [シーンファイル] [key=value ...]
+// key=value は RenderSettings::set でシーンファイルの set を上書きする
+int main( int argc, char **argv ) {
 
-	auto start_time = std::chrono::system_clock::now();
+	// 締め切りはここから数える. 時計が戻らないように steady_clock で
+	const auto start_time = std::chrono::steady_clock::now();
 
-	const int w = 800;
-	const int h = 600;
+	std::string sceneFile = "Scene/mitsumame.scene";
+	std::vector<std::string> overrides;
+	for ( int i = 1; i < argc; i++ ) {
+		const std::string arg = argv[i];
+		if ( arg.find( '=' ) == std::string::npos ) {
+			sceneFile = arg;
+		} else {
+			overrides.push_back( arg );
+		}
+	}
+
+	// ---- シーン用意
+	SceneDescription description;
+	if ( !loadSceneFile( sceneFile, &description ) ) {
+		return 1;
+	}
+	for ( const auto &arg : overrides ) {
+		const size_t eq = arg.find( '=' );
+		if ( !description.settings.set( arg.substr( 0, eq ), arg.substr( eq + 1 ) ) ) {
+			fprintf( stderr, "Invalid setting %s\n", arg.c_str() );
+			return 1;
+		}
+	}
 
-	const int sampling = 4096; // Kɑ傫
+	const RenderSettings &settings = description.settings;
+	const std::shared_ptr<Scene> &scene = description.scene;
+
+	const int w = settings.width;
+	const int h = settings.height;
+
+	const int sampling = settings.sampling;
 
 	int outputCount = 0;
-	int outputInterval = 15;
-	int timeLimit = 120;
-
-
-	// ---- V[p
-	auto scene = std::make_shared<Scene>();
-
-	// e[u
-	auto material_table = std::make_shared<GGXTextured>( std::make_shared<Texture>("Scene/wood.jpg"), 0.04f );
-	std::shared_ptr<Triangle> triangle1, triangle2;
-	triangle1 = std::make_shared<Triangle>();
-	triangle2 = std::make_shared<Triangle>();
-	float table_size = 7;
-	triangle1->v[0].p = Vector3( -table_size/2, -0.02f, -table_size / 2 );
-	triangle1->v[1].p = Vector3( table_size / 2, -0.02f, table_size / 2 );
-	triangle1->v[2].p = Vector3( table_size / 2, -0.02f, -table_size / 2 );
-	triangle2->v[0].p = Vector3( -table_size / 2, -0.02f, -table_size / 2 );
-	triangle2->v[1].p = Vector3( -table_size / 2, -0.02f, table_size / 2 );
-	triangle2->v[2].p = Vector3( table_size / 2, -0.02f, table_size / 2 );
-	triangle1->material = material_table;
-	triangle2->material = material_table;
-	triangle1->calcNormal();
-	triangle2->calcNormal();
-	triangle1->v[0].texCoord = Vector2( 0, 0 );
-	triangle1->v[1].texCoord = Vector2( 1, 1 );
-	triangle1->v[2].texCoord = Vector2( 1, 0 );
-	triangle2->v[0].texCoord = Vector2( 0, 0 );
-	triangle2->v[1].texCoord = Vector2( 0, 1 );
-	triangle2->v[2].texCoord = Vector2( 1, 1 );
-	scene->addObject( triangle1 );
-	scene->addObject( triangle2 );
-
-	// Ɩ
-	triangle1 = std::make_shared<Triangle>();
-	triangle2 = std::make_shared<Triangle>();
-	float s = 16;
-	float power = 5;
-	float light_z = -5;
-	Vector3 lightColor = Vector3(1.0f, 1.0f, 0.8f) * power;
-	triangle1->v[0].p = Vector3( 0 - s, 20.0f, light_z - s );
-	triangle1->v[1].p = Vector3( 0 + s, 20.0f, light_z - s );
-	triangle1->v[2].p = Vector3( 0 + s, 20.0f, light_z + s );
-	triangle2->v[0].p = Vector3( 0 - s, 20.0f, light_z - s );
-	triangle2->v[1].p = Vector3( 0 + s, 20.0f, light_z + s );
-	triangle2->v[2].p = Vector3( 0 - s, 20.0f, light_z + s );
-	triangle1->material = std::make_shared<Diffuse>( Vector3( 0.0f ), lightColor );
-	triangle2->material = std::make_shared<Diffuse>( Vector3( 0.0f ), lightColor );
-	triangle1->calcNormal();
-	triangle2->calcNormal();
-	scene->addObject( triangle1 );
-	scene->addObject( triangle2 );
-	scene->addExplicitLight( triangle1 );
-	scene->addExplicitLight( triangle2 );
-
-	// ݂
-	auto mesh = std::make_shared<Mesh>();
-	mesh->loadFile( "Scene/mitsumame.obj" );
-	auto meshInstance = mesh->createInstance(
-		Transform(
-		Vector3( 0, 0, 0 ),
-		Vector3( 1 ),
-		Quaternion::quaternionRotationAxis( Vector3( 0, 1, 0 ), 0.0f ) )
-	);
-	scene->addObject( meshInstance );
-
-	Camera camera;
+	const int outputInterval = settings.outputInterval;
+	const int timeLimit = settings.timeLimit;
+
+	Camera camera = description.camera;
 	camera.aspect = (float)h / w;
-	camera.horizontalFOV = 35.0f;
-	camera.position = Vector3( -0.6f, 10, -6.5f );
-	camera.eye = Vector3( 0, -1.5f, 1 ).normalize();
-	camera.up = Vector3( 0, 1, 0 );
 
-	// ---- BVH 
+	Stats::addPhaseTime( "load", std::chrono::duration<double>( std::chrono::steady_clock::now() - start_time ).count() );
+
+	// ---- BVH 作る
 	auto start_time_tmp = std::chrono::system_clock::now();
 
 	printf( "Start buillding data structure.\n" );
-	scene->buildObjectStructure();
+	scene->buildObjectStructure( settings.objectStructureType, BVHBuildMethod::BinnedSAH );
+	scene->buildLightSampler( settings.lightSamplerType );
 	printf( "Finish buillding data structure.\n" );
 
 	auto current_time_tmp = std::chrono::system_clock::now();
 	printf( "Elapsed Time : %f\n", std::chrono::duration_cast<std::chrono::milliseconds>( current_time_tmp - start_time_tmp ).count() / 1000.0f );
+	Stats::addPhaseTime( "build", std::chrono::duration<double>( current_time_tmp - start_time_tmp ).count() );
 
 
-	// ---- _O
+	// ---- レンダリング
 	start_time_tmp = std::chrono::system_clock::now();
 	printf( "Start rendering.\n" );
 
-	std::vector<Vector3> radiances( w*h );
-	std::vector<uint8_t> result( w * h * 3 );
+	std::vector<PixelStatistics> pixels( w*h );
 
-	std::shared_ptr<PathTracer> pathTracer = std::make_shared<BSDFSamplingPathTracer>();
-	PathTracer::russianRouretteProbability = 0.95f;
-	PathTracer::originOffset = 0.00001f;
+	// トーンマップと PNG の圧縮は別スレッドで. レンダリング側は線形の値を写すだけ
+	ImageWriter imageWriter( w, h, ToneMapping::toneMap );
+	std::vector<Vector3> snapshot( w * h );
 
-	int sampleCount = 0;
-	for ( sampleCount = 0; sampleCount < sampling; sampleCount++ ) {
-#pragma omp parallel for schedule(dynamic, 1)
-		for ( int i = 0; i < w * h; i++ ) {
-			try {
-				int x = i % w;
-				int y = i / w;
-				float u = ( (float)x / w - 0.5f ) * 2.0f;
-				float v = -( (float)y / h - 0.5f ) * 2.0f;
+	std::shared_ptr<PathTracer> pathTracer = std::make_shared<LightSamplingPathTracer>();
+	PathTracer::russianRouretteProbability = settings.russianRouletteProbability;
+	PathTracer::originOffset = settings.originOffset;
 
-				Vector3 &radiance = radiances[i];
-				Ray ray = camera.getRay( u, v );
+	const SamplerType samplerType = settings.samplerType;
 
-				pathTracer->evalRadiance( scene, &ray );
-				radiance += *ray.radiance;
+	// 1 回のパスでタイルごとに samplesPerPass サンプルずつ描く. 同期はパスごとに 1 回だけ
+	const int samplesPerPass = settings.samplesPerPass;
+	TileScheduler tileScheduler( w, h, 32 );
 
-			}
-			catch ( std::exception &e ) {
-				fprintf( stderr, "%s\n", e.what() );
-				// ԂΓ
-				continue;
+	// minAdaptiveSamples 以上描いたタイルは, 画素の誤差のタイル内平均が adaptiveThreshold を切ったら止める
+	// 空いたぶんはまだノイズの多いタイルに回る. adaptiveThreshold を 0 にすると全画素同じだけ描く
+	// 最大値で見ると蛍が 1 つあるだけで止まらないので平均で見る
+	const int minAdaptiveSamples = settings.minAdaptiveSamples;
+	const float adaptiveThreshold = settings.adaptiveThreshold; // 既定の 0.01 は 8 bit で 2.5 段階くらい
+
+	// 最後の出力 (画素の平均を写す + PNG) にかかる時間をとっておいて, 残りをタイル単位で使い切る
+	// 書き出しの時間は途中経過を書くたびに測り直す. まだ測っていないうちは 1 画素 1 us で見ておく (実測の倍くらい)
+	const auto deadline = start_time + std::chrono::seconds( timeLimit );
+	double snapshotSeconds = 0.0;
+	auto getOutputReserve = [&]() {
+		const double writeSeconds = imageWriter.getLastWriteSeconds();
+		return std::chrono::duration_cast<std::chrono::steady_clock::duration>( std::chrono::duration<double>( snapshotSeconds + ( writeSeconds >= 0.0 ? writeSeconds : w * h * 1e-6 ) ) );
+	};
+
+	int sampleCount = 0;
+	while ( sampleCount < sampling && tileScheduler.getActiveTileCount() > 0 ) {
+		const int passSamples = min( samplesPerPass, sampling - sampleCount );
+		tileScheduler.setDeadline( deadline - getOutputReserve() );
+		tileScheduler.reset( omp_get_max_threads() );
+		const auto passStart = std::chrono::steady_clock::now();
+#pragma omp parallel
+		{
+			auto sampler = createSampler( samplerType );
+			const int threadIndex = omp_get_thread_num();
+			int tileIndex;
+			while ( tileScheduler.next( threadIndex, passSamples, &tileIndex ) ) {
+				const auto tileStart = std::chrono::steady_clock::now();
+				const Tile &tile = tileScheduler.getTile( tileIndex );
+				float errorSum = 0.0f;
+				for ( int y = tile.y0; y < tile.y1; y++ ) {
+					for ( int x = tile.x0; x < tile.x1; x++ ) {
+						const int i = y * w + x;
+						PixelStatistics &pixel = pixels[i];
+						for ( int s = 0; s < passSamples; s++ ) {
+							try {
+								sampler->startPixelSample( i, pixel.count );
+
+								const Vector2 jitter = sampler->get2D();
+								float u = ( ( x + jitter.x ) / w - 0.5f ) * 2.0f;
+								float v = -( ( y + jitter.y ) / h - 0.5f ) * 2.0f;
+
+								Ray ray = camera.getRay( u, v );
+
+								pixel.add( pathTracer->evalRadiance( scene, ray, *sampler ) );
+
+							}
+							catch ( std::exception &e ) {
+								fprintf( stderr, "%s\n", e.what() );
+								// たぶんもっかいやれば動くやろ
+								continue;
+							}
+						}
+						errorSum += pixel.getError();
+					}
+				}
+
+				const float tileError = errorSum / ( ( tile.x1 - tile.x0 ) * ( tile.y1 - tile.y0 ) );
+				if ( adaptiveThreshold > 0.0f && sampleCount + passSamples >= minAdaptiveSamples && tileError < adaptiveThreshold ) {
+					tileScheduler.setConverged( tileIndex );
+				}
+				tileScheduler.reportTileTime( tileIndex, passSamples, std::chrono::duration<double>( std::chrono::steady_clock::now() - tileStart ).count() );
 			}
 		}
-		auto current_time = std::chrono::system_clock::now();
-		int elapsedSec = (int)std::chrono::duration_cast<std::chrono::seconds>( current_time - start_time ).count();
-		if ( elapsedSec>= outputInterval * (outputCount+1) ) {
+		sampleCount += passSamples;
+
+		auto current_time = std::chrono::steady_clock::now();
+		Stats::addPhaseTime( "render", std::chrono::duration<double>( current_time - passStart ).count() );
+		const double elapsed = std::chrono::duration<double>( current_time - start_time ).count();
+		// 締め切り間際の途中経過は最後の出力の書き出しと重なるので書かない
+		if ( elapsed >= outputInterval * ( outputCount + 1 ) && current_time + 2 * getOutputReserve() < deadline ) {
+			const auto snapshotStart = std::chrono::steady_clock::now();
 			for ( int i = 0; i < w * h; i++ ) {
-				Vector3 radiance = radiances[i];
-				radiance /= ( sampleCount + 1.0f );
-				result[i * 3 + 0] = (uint8_t)( ToneMapping::toneMap( radiance.x ) * 255 );
-				result[i * 3 + 1] = (uint8_t)( ToneMapping::toneMap( radiance.y ) * 255 );
-				result[i * 3 + 2] = (uint8_t)( ToneMapping::toneMap( radiance.z ) * 255 );
+				snapshot[i] = pixels[i].getRadiance();
 			}
+			snapshotSeconds = std::chrono::duration<double>( std::chrono::steady_clock::now() - snapshotStart ).count();
 			
 			char outputCountStr[] = "000";
 			sprintf_s( outputCountStr, 4, "%03d", outputCount );
-			std::string filename = "" + std::string( outputCountStr ) + std::string( ".png" );
-			stbi_write_png( filename.c_str(), w, h, 3, result.data(), w * 3 );
+			std::string filename = settings.outputPrefix + std::string( outputCountStr ) + std::string( ".png" );
+			imageWriter.submit( snapshot, filename );
 			++outputCount;
+			Stats::addPhaseTime( "output", std::chrono::duration<double>( std::chrono::steady_clock::now() - snapshotStart ).count() );
 		}
 
-		float timePerSample = (float) elapsedSec / (sampleCount + 1);
-		printf( "%d sample (%d %%) | %d sec | %f sec/sample\r", sampleCount+1, (int)( (float)( sampleCount + 1 ) / sampling * 100 ), elapsedSec, timePerSample );
+		printf( "%d sample (%d %%) | %d/%d tiles | %.1f sec | %f sec/sample\r", sampleCount, (int)( (float)sampleCount / sampling * 100 ), tileScheduler.getActiveTileCount(), tileScheduler.getTileCount(), elapsed, elapsed / sampleCount );
 
-		if ( elapsedSec + timePerSample >= timeLimit ) {  // ̃TvԂɍȂI
-			++sampleCount;
+		// 間に合わないタイルを飛ばしたパスがあったら, もう時間がない
+		if ( tileScheduler.isOutOfTime() || current_time + getOutputReserve() >= deadline ) {
 			break;
 		}
 	}
 	printf( "\n" );
 
+	const auto outputStart = std::chrono::steady_clock::now();
 	for ( int i = 0; i < w * h; i++ ) {
-		Vector3 &radiance = radiances[i];
-		radiance /= (float)sampleCount;
-		result[i * 3 + 0] = (uint8_t)( ToneMapping::toneMap( radiance.x ) * 255 );
-		result[i * 3 + 1] = (uint8_t)( ToneMapping::toneMap( radiance.y ) * 255 );
-		result[i * 3 + 2] = (uint8_t)( ToneMapping::toneMap( radiance.z ) * 255 );
+		snapshot[i] = pixels[i].getRadiance();
 	}
 
 	printf( "Finish rendeirng.\n" );
@@ -223,12 +239,17 @@ int main() {
 	printf( "Elapsed Time : %f\n", std::chrono::duration_cast<std::chrono::milliseconds>( current_time_tmp - start_time_tmp ).count() / 1000.0f );
 
 	{
-		auto current_time = std::chrono::system_clock::now();
-		int elapsedSec = (int)std::chrono::duration_cast<std::chrono::seconds>( current_time - start_time ).count();
 		char outputCountStr[] = "000";
 		sprintf_s( outputCountStr, 4, "%03d", outputCount );
-		std::string filename = "" + std::string( outputCountStr ) + std::string( ".png" );
-		stbi_write_png( filename.c_str(), w, h, 3, result.data(), w * 3 );
+		std::string filename = settings.outputPrefix + std::string( outputCountStr ) + std::string( ".png" );
+		imageWriter.submit( snapshot, filename );
+		imageWriter.flush();
+	}
+	Stats::addPhaseTime( "output", std::chrono::duration<double>( std::chrono::steady_clock::now() - outputStart ).count() );
+	printf( "Total Time : %f / %d\n", std::chrono::duration<double>( std::chrono::steady_clock::now() - start_time ).count(), timeLimit );
+
+	if ( !settings.statsFile.empty() ) {
+		Stats::writeJSON( settings.statsFile );
 	}
 
 	return 0;
@@ -0,0 +1,86 @@
+#include "MappedFile.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+bool MappedFile::open( const std::string &filename ) {
+	close();
+
+#ifdef _WIN32
+	HANDLE fileHandle = CreateFileA( filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr );
+	if ( fileHandle == INVALID_HANDLE_VALUE ) { return false; }
+	file = fileHandle;
+
+	LARGE_INTEGER fileSize;
+	if ( !GetFileSizeEx( fileHandle, &fileSize ) || fileSize.QuadPart == 0 ) {
+		close();
+		return false;
+	}
+	size = (size_t)fileSize.QuadPart;
+
+	mapping = CreateFileMappingA( fileHandle, nullptr, PAGE_READONLY, 0, 0, nullptr );
+	if ( mapping == nullptr ) {
+		close();
+		return false;
+	}
+	data = (const uint8_t*)MapViewOfFile( mapping, FILE_MAP_READ, 0, 0, 0 );
+#else
+	fd = ::open( filename.c_str(), O_RDONLY );
+	if ( fd < 0 ) { return false; }
+
+	struct stat st;
+	if ( fstat( fd, &st ) != 0 || st.st_size == 0 ) {
+		close();
+		return false;
+	}
+	size = (size_t)st.st_size;
+
+	void *p = mmap( nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0 );
+	data = p == MAP_FAILED ? nullptr : (const uint8_t*)p;
+#endif
+
+	if ( data == nullptr ) {
+		close();
+		return false;
+	}
+	return true;
+}
+
+void MappedFile::close() {
+#ifdef _WIN32
+	if ( data != nullptr ) { UnmapViewOfFile( data ); }
+	if ( mapping != nullptr ) { CloseHandle( mapping ); }
+	if ( file != nullptr ) { CloseHandle( file ); }
+	mapping = nullptr;
+	file = nullptr;
+#else
+	if ( data != nullptr ) { munmap( (void*)data, size ); }
+	if ( fd >= 0 ) { ::close( fd ); }
+	fd = -1;
+#endif
+	data = nullptr;
+	size = 0;
+}
+
+bool getFileStatus( const std::string &filename, uint64_t *size, int64_t *modifiedTime ) {
+#ifdef _WIN32
+	struct _stat64 st;
+	if ( _stat64( filename.c_str(), &st ) != 0 ) { return false; }
+#else
+	struct stat st;
+	if ( stat( filename.c_str(), &st ) != 0 ) { return false; }
+#endif
+	*size = (uint64_t)st.st_size;
+	*modifiedTime = (int64_t)st.st_mtime;
+	return true;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include "General.h"
+
+#include <string>
+
+// ファイルを読み込み専用でメモリに写す. close するまで getData() の中身が使える
+// 書き換えはしないので, 写している間も他からは読める
+class MappedFile {
+public:
+	MappedFile() {}
+	~MappedFile() { close(); }
+	MappedFile( const MappedFile& ) = delete;
+	MappedFile& operator=( const MappedFile& ) = delete;
+
+	bool open( const std::string &filename );
+	void close();
+
+	const uint8_t* getData() const { return data; }
+	size_t getSize() const { return size; }
+
+private:
+#ifdef _WIN32
+	void *file = nullptr;    // HANDLE
+	void *mapping = nullptr; // HANDLE
+#else
+	int fd = -1;
+#endif
+	const uint8_t *data = nullptr;
+	size_t size = 0;
+};
+
+// キャッシュが古くないかを見るための大きさと更新時刻 (秒). 無ければ false
+bool getFileStatus( const std::string &filename, uint64_t *size, int64_t *modifiedTime );
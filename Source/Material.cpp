@@ -5,10 +5,13 @@
 #include "GeometryUtils.h"
 #include "Texture.h"
 #include "Scene.h"
+#include "Sampler.h"
+#include "Stats.h"
 
-SampledRay Diffuse::sampleRay( const Ray& in, const Intersection& intersection, std::shared_ptr<Scene> scene, std::shared_ptr<ObjectStructureIteratorHistory> history ) {
-	float r1 = randf();
-	float r2 = randf();
+SampledRay Diffuse::sampleRay( const Ray& in, const Intersection& intersection, std::shared_ptr<Scene> scene, std::shared_ptr<ObjectStructureIteratorHistory> history, Sampler &sampler ) {
+	const Vector2 u = sampler.get2D();
+	float r1 = u.x;
+	float r2 = u.y;
 	BasisVector basis = genBasisVector( intersection.n );
 	SampledRay sample;
 	sample.p = intersection.p;
@@ -20,12 +23,21 @@ SampledRay Diffuse::sampleRay( const Ray& in, const Intersection& intersection,
 	const Vector3& o = sample.d;
 
 	sample.bsdf_cos_divided_p = ( dot( o, n ) > 0.0f ? albedo / PI : 0.0f ) * PI;
+	sample.pdf = clampPositive( dot( o, n ) ) / PI;
 	return std::move( sample );
 }
 
-SampledRay DiffuseTextured::sampleRay( const Ray& in, const Intersection& intersection, std::shared_ptr<Scene> scene, std::shared_ptr<ObjectStructureIteratorHistory> history ) {
-	float r1 = randf();
-	float r2 = randf();
+Vector3 Diffuse::evalBSDFCos( const Intersection &intersection, const SampledRay &sample, const Vector3 &o, float *pdf ) const {
+	const float cos_o = dot( o, intersection.n );
+	if ( cos_o <= 0.0f ) { *pdf = 0.0f; return Vector3( 0.0f ); }
+	*pdf = cos_o / PI;
+	return albedo / PI * cos_o;
+}
+
+SampledRay DiffuseTextured::sampleRay( const Ray& in, const Intersection& intersection, std::shared_ptr<Scene> scene, std::shared_ptr<ObjectStructureIteratorHistory> history, Sampler &sampler ) {
+	const Vector2 u = sampler.get2D();
+	float r1 = u.x;
+	float r2 = u.y;
 	BasisVector basis = genBasisVector( intersection.n );
 	SampledRay sample;
 	sample.p = intersection.p;
@@ -37,17 +49,26 @@ SampledRay DiffuseTextured::sampleRay( const Ray& in, const Intersection& inters
 	const Vector3& o = sample.d;
 
 	sample.bsdf_cos_divided_p = ( dot( o, n ) > 0.0f ? texture->getTexel( intersection.uv ) / PI : 0.0f ) * PI;
+	sample.pdf = clampPositive( dot( o, n ) ) / PI;
 	return std::move( sample );
 }
 
-SampledRay DipoleSSS::sampleRay( const Ray& in, const Intersection& intersection, std::shared_ptr<Scene> scene, std::shared_ptr<ObjectStructureIteratorHistory> history ) {
+Vector3 DiffuseTextured::evalBSDFCos( const Intersection &intersection, const SampledRay &sample, const Vector3 &o, float *pdf ) const {
+	const float cos_o = dot( o, intersection.n );
+	if ( cos_o <= 0.0f ) { *pdf = 0.0f; return Vector3( 0.0f ); }
+	*pdf = cos_o / PI;
+	return texture->getTexel( intersection.uv ) / PI * cos_o;
+}
+
+SampledRay DipoleSSS::sampleRay( const Ray& in, const Intersection& intersection, std::shared_ptr<Scene> scene, std::shared_ptr<ObjectStructureIteratorHistory> history, Sampler &sampler ) {
 
 	const Vector3& omega_i = -in.d;
 
 	float probeOffset = 0.2f;
 
-	float r1 = randf();
-	float r2 = randf();
+	const Vector2 u = sampler.get2D();
+	float r1 = u.x;
+	float r2 = u.y;
 	BasisVector basis = genBasisVector( intersection.n );
 	Vector3 v =
 		( 1 - powf( r1, 2 ) ) * cosf( r2 * PI * 2 ) * basis.e2
@@ -56,6 +77,7 @@ SampledRay DipoleSSS::sampleRay( const Ray& in, const Intersection& intersection
 	Ray probe;
 	probe.o = intersection.p + r_max * v + probeOffset * basis.e1;
 	probe.d = -intersection.n;
+	Stats::add( StatCounter::SSSProbeRays );
 	auto probeIntsct = scene->getIntersection( probe, history, nullptr );
 
 	Vector3 x_o, omega_o;
@@ -69,14 +91,15 @@ SampledRay DipoleSSS::sampleRay( const Ray& in, const Intersection& intersection
 	}
 
 	{
-		float r1 = randf();
-		float r2 = randf();
+		const Vector2 u = sampler.get2D();
+		float r1 = u.x;
+		float r2 = u.y;
 		BasisVector basis = genBasisVector( n_o );
 		omega_o = basis.vector( sqrtf( r2 ), cosf( 2 * PI * r1 ) * sqrtf( 1 - r2 ), sinf( 2 * PI * r1 ) * sqrtf( 1 - r2 ) );
 	}
 	SampledRay sample;
 
-	if ( randf() < F_r( omega_i, intersection.n ) ) {
+	if ( sampler.get1D() < F_r( omega_i, intersection.n ) ) {
 		sample.p = intersection.p;
 		sample.n = intersection.n;
 		sample.d = -omega_i + dot( omega_i, intersection.n ) * 2 * intersection.n;
@@ -86,11 +109,20 @@ SampledRay DipoleSSS::sampleRay( const Ray& in, const Intersection& intersection
 		sample.n = n_o;
 		sample.d = omega_o;
 		sample.bsdf_cos_divided_p = bssrdf( ( intersection.p - x_o ).length(), omega_i, omega_o, intersection.n ) * PI / ( dot( intersection.n, n_o ) / ( PI * r_max * r_max ) );
+		sample.pdf = clampPositive( dot( omega_o, n_o ) ) / PI;
 	}
 
 	return std::move( sample );
 }
 
+Vector3 DipoleSSS::evalBSDFCos( const Intersection &intersection, const SampledRay &sample, const Vector3 &o, float *pdf ) const {
+	// 表面で反射した方 (pdf 0) は光源サンプリングしない. 出射点 sample.p から o に出ていく場合だけ
+	const float cos_o = dot( o, sample.n );
+	if ( sample.pdf <= 0.0f || cos_o <= 0.0f ) { *pdf = 0.0f; return Vector3( 0.0f ); }
+	*pdf = cos_o / PI;
+	return bssrdf( ( intersection.p - sample.p ).length(), intersection.i, o, intersection.n ) * cos_o / ( dot( intersection.n, sample.n ) / ( PI * r_max * r_max ) );
+}
+
 Vector3 DipoleSSS::bssrdf( float r, const Vector3 &omega_i, const Vector3 &omega_o, const Vector3 &n ) const {
 	const float eta = refractiveIndex;
 	const float g = 0.0f;
@@ -133,9 +165,10 @@ Vector3 DipoleSSS::bssrdf( float r, const Vector3 &omega_i, const Vector3 &omega
 	return S_d( r, omega_i, omega_o );
 }
 
-SampledRay GGXRefraction::sampleRay( const Ray& in, const Intersection& intersection, std::shared_ptr<Scene> scene, std::shared_ptr<ObjectStructureIteratorHistory> history ) {
-	float r1 = randf();
-	float r2 = randf();
+SampledRay GGXRefraction::sampleRay( const Ray& in, const Intersection& intersection, std::shared_ptr<Scene> scene, std::shared_ptr<ObjectStructureIteratorHistory> history, Sampler &sampler ) {
+	const Vector2 u = sampler.get2D();
+	float r1 = u.x;
+	float r2 = u.y;
 	SampledRay sample;
 	sample.p = intersection.p;
 	sample.n = intersection.n;
@@ -157,7 +190,7 @@ SampledRay GGXRefraction::sampleRay( const Ray& in, const Intersection& intersec
 	}
 
 	float fresnel = F( i, m, eta_t, eta_i );
-	if ( randf() <= fresnel ) {
+	if ( sampler.get1D() <= fresnel ) {
 		sample.d = ( 2.0f * fabsf( dot( i, m ) ) * m - i ).normalize();
 	} else {
 		float c = dot( i, m );
@@ -175,9 +208,10 @@ SampledRay GGXRefraction::sampleRay( const Ray& in, const Intersection& intersec
 	return std::move( sample );
 }
 
-SampledRay GGXReflection::sampleRay( const Ray& in, const Intersection& intersection, std::shared_ptr<Scene> scene, std::shared_ptr<ObjectStructureIteratorHistory> history ) {
-	float r1 = randf();
-	float r2 = randf();
+SampledRay GGXReflection::sampleRay( const Ray& in, const Intersection& intersection, std::shared_ptr<Scene> scene, std::shared_ptr<ObjectStructureIteratorHistory> history, Sampler &sampler ) {
+	const Vector2 u = sampler.get2D();
+	float r1 = u.x;
+	float r2 = u.y;
 	SampledRay sample;
 	sample.p = intersection.p;
 	sample.n = intersection.n;
@@ -195,13 +229,27 @@ SampledRay GGXReflection::sampleRay( const Ray& in, const Intersection& intersec
 
 	float weight = fabsf( dot( i, m ) * G( i, o, m, n ) / ( dot( i, n ) * dot( m, n ) ) );
 	sample.bsdf_cos_divided_p = albedo * Vector3( weight );
+	// D は cos(theta_m) 込みなのでハーフベクトルの密度そのもの. 裏から当たったときは evalBSDFCos と揃えて 0
+	sample.pdf = dot( i, n ) > 0.0f ? D( m, n ) / ( 4.0f * fabsf( dot( o, m ) ) ) : 0.0f;
 
 	return std::move( sample );
 }
 
-SampledRay GGXTextured::sampleRay( const Ray& in, const Intersection& intersection, std::shared_ptr<Scene> scene, std::shared_ptr<ObjectStructureIteratorHistory> history ) {
-	float r1 = randf();
-	float r2 = randf();
+Vector3 GGXReflection::evalBSDFCos( const Intersection &intersection, const SampledRay &sample, const Vector3 &o, float *pdf ) const {
+	const Vector3 &i = intersection.i;
+	const Vector3 &n = intersection.n;
+	if ( dot( i, n ) <= 0.0f || dot( o, n ) <= 0.0f ) { *pdf = 0.0f; return Vector3( 0.0f ); }
+
+	const Vector3 m = ( i + o ).normalize();
+	const float d = D( m, n );
+	*pdf = d / ( 4.0f * fabsf( dot( o, m ) ) );
+	return albedo * ( d / dot( m, n ) * G( i, o, m, n ) / ( 4.0f * dot( i, n ) ) );
+}
+
+SampledRay GGXTextured::sampleRay( const Ray& in, const Intersection& intersection, std::shared_ptr<Scene> scene, std::shared_ptr<ObjectStructureIteratorHistory> history, Sampler &sampler ) {
+	const Vector2 u = sampler.get2D();
+	float r1 = u.x;
+	float r2 = u.y;
 	SampledRay sample;
 	sample.p = intersection.p;
 	sample.n = intersection.n;
@@ -219,6 +267,39 @@ SampledRay GGXTextured::sampleRay( const Ray& in, const Intersection& intersecti
 
 	float weight = fabsf( dot( i, m ) * G( i, o, m, n ) / ( dot( i, n ) * dot( m, n ) ) );
 	sample.bsdf_cos_divided_p = texture->getTexel( intersection.uv ) * Vector3( weight );
+	// D は cos(theta_m) 込みなのでハーフベクトルの密度そのもの. 裏から当たったときは evalBSDFCos と揃えて 0
+	sample.pdf = dot( i, n ) > 0.0f ? D( m, n ) / ( 4.0f * fabsf( dot( o, m ) ) ) : 0.0f;
 
 	return std::move( sample );
-}
\ No newline at end of file
+}
+
+Vector3 GGXTextured::evalBSDFCos( const Intersection &intersection, const SampledRay &sample, const Vector3 &o, float *pdf ) const {
+	const Vector3 &i = intersection.i;
+	const Vector3 &n = intersection.n;
+	if ( dot( i, n ) <= 0.0f || dot( o, n ) <= 0.0f ) { *pdf = 0.0f; return Vector3( 0.0f ); }
+
+	const Vector3 m = ( i + o ).normalize();
+	const float d = D( m, n );
+	*pdf = d / ( 4.0f * fabsf( dot( o, m ) ) );
+	return texture->getTexel( intersection.uv ) * ( d / dot( m, n ) * G( i, o, m, n ) / ( 4.0f * dot( i, n ) ) );
+}
+
+SampledRay IsotopicMedia::sampleRay( const Ray& in, const Intersection& intersection, std::shared_ptr<Scene> scene, std::shared_ptr<ObjectStructureIteratorHistory> history, Sampler &sampler ) {
+	SampledRay sample;
+	sample.p = intersection.p;
+	sample.n = intersection.n;
+
+	const Vector2 u = sampler.get2D();
+	const float r1 = u.x;
+	const float r2 = u.y;
+	sample.d = Vector3( 2 * cosf( 2.0f * PI * r1 ) * sqrtf( r2 * ( 1.0f - r2 ) ),
+						2 * sinf( 2.0f * PI * r1 ) * sqrtf( r2 * ( 1.0f - r2 ) ),
+						1 - 2.0f * r2 );
+
+	Vector3 phaseFunction = albedo * ( 1.0f / ( 4.0f * PI ) );
+	float pdf_o = 1.0f / ( 4.0f * PI );
+
+	sample.bsdf_cos_divided_p = transmittance( intersection.t ) * scatteringCoefficient * phaseFunction / ( pdf_o * pdf_t( intersection.t ) );
+
+	return std::move( sample );
+}
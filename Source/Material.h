@@ -2,6 +2,7 @@
 
 class Scene;
 class Texture;
+class Sampler;
 struct ObjectStructureIteratorHistory;
 
 struct SampledRay {
@@ -9,11 +10,18 @@ struct SampledRay {
 	Vector3 p;
 	Vector3 n;
 	Vector3 bsdf_cos_divided_p;
+	float pdf = 0.0f; // d を選んだ立体角あたりの確率密度. 0 ならデルタ分布扱いで光源サンプリングしない
 };
 
 struct Material : public std::enable_shared_from_this<Material> {
-	virtual SampledRay sampleRay( const Ray& in, const Intersection& intersection, std::shared_ptr<Scene> scene, std::shared_ptr<ObjectStructureIteratorHistory> history ) = 0;
+	// sampleRay が sampler から取る次元の数の上限 (DipoleSSS の 2D, 2D, 1D)
+	static const int maxSampleDimensions = 3;
+
+	virtual SampledRay sampleRay( const Ray& in, const Intersection& intersection, std::shared_ptr<Scene> scene, std::shared_ptr<ObjectStructureIteratorHistory> history, Sampler &sampler ) = 0;
 	virtual Vector3 getEmission() { return Vector3( 0.0f ); }
+	// sample.p から o 方向に出ていくときの bsdf * cos (sampleRay の bsdf_cos_divided_p と同じ流儀)
+	// *pdf には sampleRay が o を選ぶ確率密度を入れる
+	virtual Vector3 evalBSDFCos( const Intersection &intersection, const SampledRay &sample, const Vector3 &o, float *pdf ) const { *pdf = 0.0f; return Vector3( 0.0f ); }
 
 	std::shared_ptr<ParticipatingMedia> participatingMedia;
 };
@@ -26,15 +34,16 @@ struct ParticipatingMedia : public Material {
 		return expf( -t * extinctionCoefficient() );
 	}
 	float pdf_t( float t ) { return extinctionCoefficient() * exp( -extinctionCoefficient() * t ); }
-	float sampleDistance() {
-		return -logf( randf() ) / extinctionCoefficient();
+	float sampleDistance( float u ) {
+		return -logf( 1.0f - u ) / extinctionCoefficient();
 	}
 };
 
 struct Diffuse : public Material {
 	Diffuse( const Vector3& albedo ) : albedo( albedo ), emission( Vector3( 0.0f ) ) {}
 	Diffuse( const Vector3& albedo, const Vector3& emission ) : albedo( albedo ), emission( emission ) {}
-	virtual SampledRay sampleRay( const Ray& in, const Intersection& intersection, std::shared_ptr<Scene> scene, std::shared_ptr<ObjectStructureIteratorHistory> history );
+	virtual SampledRay sampleRay( const Ray& in, const Intersection& intersection, std::shared_ptr<Scene> scene, std::shared_ptr<ObjectStructureIteratorHistory> history, Sampler &sampler );
+	virtual Vector3 evalBSDFCos( const Intersection &intersection, const SampledRay &sample, const Vector3 &o, float *pdf ) const;
 	virtual Vector3 getEmission() { return emission; }
 
 	Vector3 albedo;
@@ -43,7 +52,8 @@ struct Diffuse : public Material {
 
 struct DiffuseTextured : public Material {
 	DiffuseTextured( std::shared_ptr<Texture> texture ) : texture( texture ) {}
-	virtual SampledRay sampleRay( const Ray& in, const Intersection& intersection, std::shared_ptr<Scene> scene, std::shared_ptr<ObjectStructureIteratorHistory> history );
+	virtual SampledRay sampleRay( const Ray& in, const Intersection& intersection, std::shared_ptr<Scene> scene, std::shared_ptr<ObjectStructureIteratorHistory> history, Sampler &sampler );
+	virtual Vector3 evalBSDFCos( const Intersection &intersection, const SampledRay &sample, const Vector3 &o, float *pdf ) const;
 	virtual Vector3 getEmission() { return Vector3( 0.0f ); }
 
 	std::shared_ptr<Texture> texture;
@@ -54,7 +64,8 @@ struct DipoleSSS : public Material {
 		scatteringCoefficient = albedo * extinction;
 		absorptionCoefficient = Vector3( extinction ) - scatteringCoefficient;
 	}
-	virtual SampledRay sampleRay( const Ray& in, const Intersection& intersection, std::shared_ptr<Scene> scene, std::shared_ptr<ObjectStructureIteratorHistory> history );
+	virtual SampledRay sampleRay( const Ray& in, const Intersection& intersection, std::shared_ptr<Scene> scene, std::shared_ptr<ObjectStructureIteratorHistory> history, Sampler &sampler );
+	virtual Vector3 evalBSDFCos( const Intersection &intersection, const SampledRay &sample, const Vector3 &o, float *pdf ) const;
 	virtual Vector3 getEmission() { return Vector3( 0.0f ); }
 	Vector3 bssrdf( float r, const Vector3 &omega_i, const Vector3 &omega_o, const Vector3 &n ) const;
 	float F_r( const Vector3 &i, const Vector3 &n ) const {
@@ -77,7 +88,7 @@ struct DipoleSSS : public Material {
 struct NullSurface : public Material {
 	NullSurface() {}
 
-	virtual SampledRay sampleRay( const Ray& in, const Intersection& intersection, std::shared_ptr<Scene> scene, std::shared_ptr<ObjectStructureIteratorHistory> history ) {
+	virtual SampledRay sampleRay( const Ray& in, const Intersection& intersection, std::shared_ptr<Scene> scene, std::shared_ptr<ObjectStructureIteratorHistory> history, Sampler &sampler ) {
 		SampledRay sample;
 		sample.p = intersection.p;
 		sample.n = intersection.n;
@@ -94,7 +105,7 @@ struct NullSurface : public Material {
 
 struct GGXRefraction : public Material {
 	GGXRefraction( float refractiveIndex, float alpha_g ) : refractiveIndex( refractiveIndex ), alpha_g( alpha_g ) {}
-	virtual SampledRay sampleRay( const Ray& in, const Intersection& intersection, std::shared_ptr<Scene> scene, std::shared_ptr<ObjectStructureIteratorHistory> history );
+	virtual SampledRay sampleRay( const Ray& in, const Intersection& intersection, std::shared_ptr<Scene> scene, std::shared_ptr<ObjectStructureIteratorHistory> history, Sampler &sampler );
 	virtual Vector3 getEmission() { return Vector3( 0.0f ); }
 	float F( const Vector3 &i, const Vector3 &m, float eta_t, float eta_i ) const {
 		float c = fabsf( dot( i, m ) );
@@ -123,7 +134,8 @@ struct GGXRefraction : public Material {
 
 struct GGXReflection : public Material {
 	GGXReflection( const Vector3 &albedo, float alpha_g ) : albedo( albedo ), alpha_g( alpha_g ) {}
-	virtual SampledRay sampleRay( const Ray& in, const Intersection& intersection, std::shared_ptr<Scene> scene, std::shared_ptr<ObjectStructureIteratorHistory> history );
+	virtual SampledRay sampleRay( const Ray& in, const Intersection& intersection, std::shared_ptr<Scene> scene, std::shared_ptr<ObjectStructureIteratorHistory> history, Sampler &sampler );
+	virtual Vector3 evalBSDFCos( const Intersection &intersection, const SampledRay &sample, const Vector3 &o, float *pdf ) const;
 	virtual Vector3 getEmission() { return Vector3( 0.0f ); }
 	float G1( const Vector3 &v, const Vector3 &m, const Vector3 &n ) const {
 		float tan_theta_v_sq = 1.0f / powf( dot( n, v ), 2.0f ) - 1.0f;
@@ -145,9 +157,10 @@ struct GGXReflection : public Material {
 };
 
 struct GGXTextured : public Material {
-	// GGXReflection Ƃقڒgꏏ
+	// GGXReflection とほぼ中身一緒
 	GGXTextured( std::shared_ptr<Texture> texture, float alpha_g ) :texture( texture ), alpha_g( alpha_g ) {}
-	virtual SampledRay sampleRay( const Ray& in, const Intersection& intersection, std::shared_ptr<Scene> scene, std::shared_ptr<ObjectStructureIteratorHistory> history );
+	virtual SampledRay sampleRay( const Ray& in, const Intersection& intersection, std::shared_ptr<Scene> scene, std::shared_ptr<ObjectStructureIteratorHistory> history, Sampler &sampler );
+	virtual Vector3 evalBSDFCos( const Intersection &intersection, const SampledRay &sample, const Vector3 &o, float *pdf ) const;
 	virtual Vector3 getEmission() { return Vector3( 0.0f ); }
 	float G1( const Vector3 &v, const Vector3 &m, const Vector3 &n ) const {
 		float tan_theta_v_sq = 1.0f / powf( dot( n, v ), 2.0f ) - 1.0f;
@@ -168,24 +181,7 @@ struct GGXTextured : public Material {
 };
 
 struct IsotopicMedia : public ParticipatingMedia {
-	virtual SampledRay sampleRay( const Ray& in, const Intersection& intersection, std::shared_ptr<Scene> scene, std::shared_ptr<ObjectStructureIteratorHistory> history ) {
-		SampledRay sample;
-		sample.p = intersection.p;
-		sample.n = intersection.n;
-
-		float r1 = randf();
-		float r2 = randf();
-		sample.d = Vector3( 2 * cosf( 2.0f * PI * r1 ) * sqrtf( r2 * ( 1.0f - r2 ) ),
-							2 * sinf( 2.0f * PI * r1 ) * sqrtf( r2 * ( 1.0f - r2 ) ),
-							1 - 2.0f * r2 );
-
-		Vector3 phaseFunction = albedo * ( 1.0f / ( 4.0f * PI ) );
-		float pdf_o = 1.0f / ( 4.0f * PI );
-
-		sample.bsdf_cos_divided_p = transmittance( intersection.t ) * scatteringCoefficient * phaseFunction / ( pdf_o * pdf_t( intersection.t ) );
-
-		return std::move( sample );
-	}
+	virtual SampledRay sampleRay( const Ray& in, const Intersection& intersection, std::shared_ptr<Scene> scene, std::shared_ptr<ObjectStructureIteratorHistory> history, Sampler &sampler );
 
 	Vector3 albedo;
 };
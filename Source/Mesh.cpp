@@ -2,107 +2,116 @@
 #include "Mesh.h"
 #include "ObjectStructure.h"
 #include "Material.h"
-#include "3rdparty/OBJ_Loader.h"
 #include "Quaternion.h"
-
-void Mesh::loadFile( std::string filename ) {
-	objl::Loader loader;
-	loader.LoadFile( filename.c_str() );
-
-	// }eAŐĊ蓖Ăˊюdl
-
-	auto material_diffuse = std::make_shared<Diffuse>( Vector3( 0.2f, 0.2f, 0.2f ) );
-	auto material_mame = std::make_shared<DipoleSSS>( Vector3( 0.6f, 0.3f, 0.1f ), 30.0f, 1.35f, 0.1f );
-	auto material_shiratama = std::make_shared<DipoleSSS>( Vector3( 1.0f, 1.0f, 1.0f ), 20.0f, 1.35f, 0.2f );
-	auto material_mikan = std::make_shared<DipoleSSS>( Vector3( 0.68f, 0.68f, 0.16f ), 10.0f, 1.35f, 0.4f );
-	auto material_spoon = std::make_shared<GGXReflection>( Vector3( 0.15f, 0.15f, 0.15f ), 0.1f );
-	auto material_kanten = std::make_shared<GGXRefraction>( 0.7f, 0.001f );
-	auto media_kanten = std::make_shared<IsotopicMedia>();
-	media_kanten->albedo = Vector3(1.0f,1.0f,0.98f);
-	float a = 0.6f;
-	float extinction = 5.0f;
-	media_kanten->absorptionCoefficient = extinction * (1-a);
-	media_kanten->scatteringCoefficient = extinction * a;
-	material_kanten->participatingMedia = media_kanten;
-
-	auto material_sara_in = std::make_shared<DipoleSSS>( Vector3( 0.15f, 0.22f, 0.15f ), 50.0f, 2.0f, 0.3f );
-	auto material_sara_out = material_sara_in;
-
-	auto material_cup = std::make_shared<DipoleSSS>( Vector3( 0.18f, 0.16f, 0.12f ), 50.0f, 2.0f, 0.3f );;
-	auto material_mitsu = std::make_shared<GGXRefraction>( 1.2f, 0.001f );
-	auto media_mitsu = std::make_shared<IsotopicMedia>();
-	media_mitsu->albedo = Vector3( 1.0f, 1.0f, 0.9f );
-	a = 0.01f;
-	extinction = 20.0f;
-	media_mitsu->absorptionCoefficient = extinction * ( 1 - a );
-	media_mitsu->scatteringCoefficient = extinction * a;
-	material_mitsu->participatingMedia = media_mitsu;
-
-	for (const auto &mesh : loader.LoadedMeshes) {
-		std::shared_ptr<Material> material = material_diffuse;
-
-		if ( mesh.MeshName.substr( 0, 6 ) == std::string("kanten") ) {
-			material = material_kanten;
-		}
-		if ( mesh.MeshName.substr( 0, 4 ) == std::string( "mame" ) ) {
-			material = material_mame;
-		}
-		if ( mesh.MeshName.substr( 0, 5 ) == std::string( "spoon" ) ) {
-			material = material_spoon;
-		}
-		if ( mesh.MeshName.substr( 0, 7 ) == std::string( "sara_in" ) ) {
-			material = material_sara_in;
-		}
-		if ( mesh.MeshName.substr( 0, 8 ) == std::string( "sara_out" ) ) {
-			material = material_sara_out;
+#include "MeshCache.h"
+#include "ObjReader.h"
+#include "BVH4.h"
+
+std::shared_ptr<Material> MeshMaterialMap::find( const std::string &name ) const {
+	std::shared_ptr<Material> material = defaultMaterial;
+	size_t length = 0;
+	for ( const auto &prefix : prefixes ) {
+		if ( prefix.first.size() >= length && name.compare( 0, prefix.first.size(), prefix.first ) == 0 ) {
+			material = prefix.second;
+			length = prefix.first.size();
 		}
-		if ( mesh.MeshName.substr( 0, 9 ) == std::string( "shiratama" ) ) {
-			material = material_shiratama;
-		}
-		if ( mesh.MeshName.substr( 0, 5 ) == std::string( "mikan" ) ) {
-			material = material_mikan;
-		}
-		if ( mesh.MeshName.substr( 0, 3 ) == std::string( "cup" ) ) {
-			material = material_cup;
-		}
-		if ( mesh.MeshName.substr( 0, 5 ) == std::string( "mitsu" ) ) {
-			material = material_mitsu;
+	}
+	return material;
+}
+
+bool Mesh::loadFile( const std::string &filename, const MeshMaterialMap &materials ) {
+	// BVH のキャッシュは 1 つのファイルだけでできたメッシュにしか使えない
+	const bool firstFile = triangleMesh->getTriangleCount() == 0;
+
+	// OBJ の隣にあるキャッシュが新しければ, OBJ は読まずにそれを写す
+	const std::string cacheFile = filename + ".xmesh";
+	cache = std::make_shared<MeshCache>();
+	if ( cache->open( cacheFile, filename ) ) {
+		createTriangles( cache->getArrays(), materials );
+		bvhCacheFile = firstFile ? cacheFile : "";
+		if ( !firstFile ) { cache = nullptr; }
+		return true;
+	}
+	cache = nullptr;
+
+	ObjData obj;
+	if ( !readObjFile( filename, &obj ) ) { return false; }
+	const MeshArrays arrays = obj.getArrays();
+
+	// 書けなくても (読み込み専用の場所など) 毎回 OBJ を読むだけ
+	if ( MeshCache::write( cacheFile, filename, arrays ) ) {
+		bvhCacheFile = firstFile ? cacheFile : "";
+	} else {
+		fprintf( stderr, "Cannot write mesh cache %s\n", cacheFile.c_str() );
+		bvhCacheFile.clear();
+	}
+
+	createTriangles( arrays, materials );
+	return true;
+}
+
+void Mesh::createTriangles( const MeshArrays &arrays, const MeshMaterialMap &materials ) {
+	TriangleMesh &mesh = *triangleMesh;
+	auto material_default = materials.defaultMaterial ? materials.defaultMaterial : std::make_shared<Diffuse>( Vector3( 0.2f, 0.2f, 0.2f ) );
+	const uint32_t materialBase = (uint32_t)mesh.materials.size();
+	for ( const auto &name : arrays.groupNames ) {
+		std::shared_ptr<Material> material = materials.find( name );
+		mesh.materials.push_back( material ? material : material_default );
+	}
+
+	// 前に読んだファイルの後ろに足す
+	const uint32_t vertexBase = (uint32_t)mesh.positions.size();
+	mesh.positions.reserve( vertexBase + arrays.vertexCount );
+	mesh.normals.reserve( vertexBase + arrays.vertexCount );
+	mesh.texCoords.reserve( vertexBase + arrays.vertexCount );
+	for ( uint32_t i = 0; i < arrays.vertexCount; i++ ) {
+		mesh.positions.push_back( Vector3( arrays.positions[i * 3 + 0], arrays.positions[i * 3 + 1], arrays.positions[i * 3 + 2] ) );
+		mesh.normals.push_back( Vector3( arrays.normals[i * 3 + 0], arrays.normals[i * 3 + 1], arrays.normals[i * 3 + 2] ) );
+		mesh.texCoords.push_back( Vector2( arrays.texCoords[i * 2 + 0], arrays.texCoords[i * 2 + 1] ) );
+	}
+
+	mesh.indices.reserve( mesh.indices.size() + arrays.triangleCount * 3 );
+	mesh.materialIds.reserve( mesh.materialIds.size() + arrays.triangleCount );
+	for ( uint32_t i = 0; i < arrays.triangleCount; i++ ) {
+		for ( int k = 0; k < 3; k++ ) {
+			mesh.indices.push_back( vertexBase + arrays.indices[i * 3 + k] );
 		}
+		mesh.materialIds.push_back( materialBase + arrays.groups[i] );
+	}
+
+	for ( uint32_t i = 0; i < (uint32_t)mesh.indices.size(); i++ ) {
+		const Vector3 &p = mesh.positions[mesh.indices[i]];
+		aabb = i == 0 ? AABB{ p, p } : ( aabb | AABB{ p, p } );
+	}
+}
+
+std::shared_ptr<ObjectStructure> Mesh::buildObjectStructure( ObjectStructureType type, BVHBuildMethod method ) {
+	if ( objectStructure != nullptr ) { return objectStructure; }
+
+	// 二分木の BVH をキャッシュから読むか作るかして, BVH4 ならそれを潰す
+	// どちらでも三角形は BVH の葉の順に並べ替わる
+	std::shared_ptr<BVH> bvh;
+	std::vector<LinearBVHNode> nodes;
+	std::vector<uint32_t> primitiveIndices;
+	if ( cache && cache->getBVH( method, &nodes, &primitiveIndices ) && primitiveIndices.size() == triangleMesh->getTriangleCount() ) {
+		bvh = std::make_shared<BVH>( std::move( nodes ), std::move( primitiveIndices ), triangleMesh );
+	}
+	// 写すのはここまで. キャッシュに書き足す前に閉じる
+	cache = nullptr;
 
-		const auto &indices = mesh.Indices;
-		const auto &vertices = mesh.Vertices;
-
-		triangles.reserve( triangles.size() + indices.size() / 3 );
-		for ( int i = 0; i < indices.size() / 3; i++ ) {
-			const auto &v0 = vertices[indices[i * 3 + 0]];
-			const auto &v1 = vertices[indices[i * 3 + 1]];
-			const auto &v2 = vertices[indices[i * 3 + 2]];
-			auto triangle = std::make_shared<Triangle>();
-
-			auto f = []( objl::Vertex in ) {
-				Vertex v;
-				v.p.x = in.Position.X;
-				v.p.y = in.Position.Y;
-				v.p.z = in.Position.Z;
-				v.n.x = in.Normal.X;
-				v.n.y = in.Normal.Y;
-				v.n.z = in.Normal.Z;
-
-				v.texCoord.x = in.TextureCoordinate.X;
-				v.texCoord.y = in.TextureCoordinate.Y;
-				return v;
-			};
-
-			triangle->v[0] = f( v0 );
-			triangle->v[1] = f( v1 );
-			triangle->v[2] = f( v2 );
-
-			triangle->material = material;
-
-			triangles.push_back( triangle );
+	if ( bvh == nullptr ) {
+		bvh = std::make_shared<BVH>( triangleMesh, method );
+		if ( !bvhCacheFile.empty() ) {
+			MeshCache::writeBVH( bvhCacheFile, method, bvh->getNodes(), bvh->getPrimitiveIndices() );
 		}
 	}
 
+	if ( type == ObjectStructureType::BVH4 ) {
+		objectStructure = std::make_shared<BVH4>( *bvh );
+	} else {
+		objectStructure = bvh;
+	}
+	return objectStructure;
 }
 
 std::shared_ptr<MeshInstance> Mesh::createInstance( const Transform &t ) {
@@ -110,35 +119,46 @@ std::shared_ptr<MeshInstance> Mesh::createInstance( const Transform &t ) {
 }
 
 
-MeshInstance::MeshInstance( std::shared_ptr<Mesh> mesh, const Transform &t ) {
-	triangles.reserve( mesh->getTriangles().size() );
-	for ( int i = 0; i < mesh->getTriangles().size(); i++ ) {
-		auto triangle = std::make_shared<Triangle>();
-		auto origTri = std::static_pointer_cast<Triangle>( mesh->getTriangles()[i] );
-		*triangle = *origTri;
-
-		triangle->v[0].p *= t.rotation;
-		triangle->v[1].p *= t.rotation;
-		triangle->v[2].p *= t.rotation;
-		triangle->v[0].n *= t.rotation;
-		triangle->v[1].n *= t.rotation;
-		triangle->v[2].n *= t.rotation;
+MeshInstance::MeshInstance( std::shared_ptr<Mesh> mesh, const Transform &t ) : mesh( mesh ) {
+	objectToWorld = t.toAffineTransform();
+	worldToObject = objectToWorld.inverse();
 
-		triangle->v[0].p *= t.scale;
-		triangle->v[1].p *= t.scale;
-		triangle->v[2].p *= t.scale;
-		triangle->v[0].p += t.position;
-		triangle->v[1].p += t.position;
-		triangle->v[2].p += t.position;
+	// メッシュの AABB の 8 頂点を変換して囲む
+	const AABB &local = mesh->getAABB();
+	for ( int i = 0; i < 8; i++ ) {
+		Vector3 corner(
+			( i & 1 ) ? local.max.x : local.min.x,
+			( i & 2 ) ? local.max.y : local.min.y,
+			( i & 4 ) ? local.max.z : local.min.z );
+		Vector3 p = objectToWorld.transformPoint( corner );
+		aabb = i == 0 ? AABB{ p, p } : ( aabb | AABB{ p, p } );
+	}
+}
 
-		triangle->material = origTri->material;
+Ray MeshInstance::toLocalRay( const Ray &ray ) const {
+	// 方向は正規化しないので t はワールド空間と同じになる
+	Ray localRay;
+	localRay.o = worldToObject.transformPoint( ray.o );
+	localRay.d = worldToObject.transformVector( ray.d );
+	localRay.depth = ray.depth;
+	return localRay;
+}
 
-		triangles.push_back( triangle );
-	}
+bool MeshInstance::intersect( const Ray &ray, const PrecomputedRay &precomputedRay, Hit *hit ) const {
+	if ( !mesh->getObjectStructure()->intersect( toLocalRay( ray ), hit ) ) { return false; }
+	hit->instance = this;
+	return true;
+}
 
-	aabb = ::getAABB( triangles );
+bool MeshInstance::occluded( const Ray &ray, const PrecomputedRay &precomputedRay, float tMax ) const {
+	return mesh->getObjectStructure()->occluded( toLocalRay( ray ), tMax );
 }
 
-std::shared_ptr<ObjectStructure> MeshInstance::buildObjectStructure() const {
-	return ::buildObjectStructure( triangles );
-}
\ No newline at end of file
+Intersection MeshInstance::createIntersection( const Ray &ray, const Hit &hit ) const {
+	Intersection intersection = mesh->getTriangleMesh()->createIntersection( toLocalRay( ray ), hit );
+	intersection.p = objectToWorld.transformPoint( intersection.p );
+	intersection.n = worldToObject.transformTransposed( intersection.n ).normalize();
+	intersection.i = -ray.d;
+	intersection.object = shared_from_this();
+	return intersection;
+}
@@ -6,25 +6,61 @@
 struct Transform;
 class ObjectStructure;
 class MeshInstance;
+enum class ObjectStructureType;
+enum class BVHBuildMethod;
+
+struct Material;
+struct MeshArrays;
+class MeshCache;
+
+// OBJ のオブジェクト名からマテリアルを決める
+// 名前の先頭が一致した中で一番長い prefix のものを使う. どれも一致しなければ defaultMaterial
+struct MeshMaterialMap {
+	std::shared_ptr<Material> defaultMaterial;
+	std::vector<std::pair<std::string, std::shared_ptr<Material>>> prefixes;
+
+	std::shared_ptr<Material> find( const std::string &name ) const;
+};
 
 class Mesh : public std::enable_shared_from_this<Mesh> {
 public:
-	void loadFile(std::string filename);
+	// defaultMaterial が空なら灰色の Diffuse にする
+	// 読んだものは filename.xmesh にキャッシュしておいて, 次からはそれを写す
+	// 読めなければ (理由は readObjFile が出す) 三角形を足さずに false
+	bool loadFile(const std::string &filename, const MeshMaterialMap &materials = MeshMaterialMap());
 	std::shared_ptr<MeshInstance> createInstance(const Transform &t);
-	const spvector<Object>& getTriangles() { return triangles; }
+	const std::shared_ptr<TriangleMesh>& getTriangleMesh() const { return triangleMesh; }
+	const AABB& getAABB() const { return aabb; }
+
+	// インスタンス間で共有する BVH. 一度だけ作る
+	std::shared_ptr<ObjectStructure> buildObjectStructure(ObjectStructureType type, BVHBuildMethod method);
+	std::shared_ptr<ObjectStructure> getObjectStructure() const { return objectStructure; }
 private:
-	spvector<Object> triangles;
+	void createTriangles(const MeshArrays &arrays, const MeshMaterialMap &materials);
+
+	std::shared_ptr<TriangleMesh> triangleMesh = std::make_shared<TriangleMesh>();
+	AABB aabb;
+	std::shared_ptr<ObjectStructure> objectStructure;
+	std::shared_ptr<MeshCache> cache; // 写したキャッシュ. BVH を読むまで開いておく
+	std::string bvhCacheFile;         // 作った BVH を書き足すところ. 空なら書かない
 };
 
-class MeshInstance : public Object {
+class MeshInstance : public PrimitiveObject {
 public:
 	MeshInstance(std::shared_ptr<Mesh> mesh, const Transform &t);
 
-	std::shared_ptr<ObjectStructure> buildObjectStructure() const;
+	const std::shared_ptr<Mesh>& getMesh() const { return mesh; }
 
+	virtual bool intersect(const Ray &ray, const PrecomputedRay &precomputedRay, Hit *hit) const;
+	virtual Intersection createIntersection(const Ray &ray, const Hit &hit) const;
+	virtual bool occluded(const Ray &ray, const PrecomputedRay &precomputedRay, float tMax) const;
 	virtual AABB getAABB() { return aabb; }
 
 private:
-	spvector<Object> triangles;
+	Ray toLocalRay(const Ray &ray) const;
+
+	std::shared_ptr<Mesh> mesh;
+	AffineTransform objectToWorld;
+	AffineTransform worldToObject;
 	AABB aabb;
-};
\ No newline at end of file
+};
@@ -0,0 +1,182 @@
+#include "MeshCache.h"
+
+#include <fstream>
+#include <cstring>
+
+namespace {
+
+const char magic[4] = { 'X', 'M', 'S', 'H' };
+const uint32_t version = 1;
+
+// 各配列の先頭. 写したまま float として読めるように 32 バイトに揃える
+struct Layout {
+	uint64_t positions, normals, texCoords, indices, groups, groupNames, bvhNodes, bvhPrimitives, end;
+
+	Layout( uint32_t vertexCount, uint32_t triangleCount, uint32_t groupNamesSize, uint32_t bvhNodeCount, uint32_t bvhPrimitiveCount ) {
+		auto align = []( uint64_t offset ) { return ( offset + 31 ) & ~(uint64_t)31; };
+		positions = align( sizeof( MeshCacheHeader ) );
+		normals = align( positions + (uint64_t)vertexCount * 3 * sizeof( float ) );
+		texCoords = align( normals + (uint64_t)vertexCount * 3 * sizeof( float ) );
+		indices = align( texCoords + (uint64_t)vertexCount * 2 * sizeof( float ) );
+		groups = align( indices + (uint64_t)triangleCount * 3 * sizeof( uint32_t ) );
+		groupNames = align( groups + (uint64_t)triangleCount * sizeof( uint32_t ) );
+		bvhNodes = align( groupNames + groupNamesSize );
+		bvhPrimitives = align( bvhNodes + (uint64_t)bvhNodeCount * sizeof( LinearBVHNode ) );
+		end = bvhPrimitives + (uint64_t)bvhPrimitiveCount * sizeof( uint32_t );
+	}
+};
+
+void writeAt( std::ostream &os, uint64_t offset, const void *data, size_t size ) {
+	os.seekp( offset );
+	os.write( (const char*)data, size );
+}
+
+};
+
+bool MeshCache::open( const std::string &cacheFile, const std::string &sourceFile ) {
+	close();
+
+	uint64_t sourceSize;
+	int64_t sourceTime;
+	if ( !getFileStatus( sourceFile, &sourceSize, &sourceTime ) ) { return false; }
+	if ( !file.open( cacheFile ) ) { return false; }
+
+	const uint8_t *data = file.getData();
+	const MeshCacheHeader *h = (const MeshCacheHeader*)data;
+	if ( file.getSize() < sizeof( MeshCacheHeader ) || memcmp( h->magic, magic, sizeof( magic ) ) != 0 || h->version != version
+		|| h->sourceSize != sourceSize || h->sourceTime != sourceTime ) {
+		close();
+		return false;
+	}
+
+	// 書いている途中で止まったものは短くなっている
+	const Layout layout( h->vertexCount, h->triangleCount, h->groupNamesSize, h->bvhNodeCount, h->bvhPrimitiveCount );
+	if ( file.getSize() < ( h->bvhMethod >= 0 ? layout.end : layout.groupNames + h->groupNamesSize ) ) {
+		close();
+		return false;
+	}
+
+	arrays.vertexCount = h->vertexCount;
+	arrays.triangleCount = h->triangleCount;
+	arrays.positions = (const float*)( data + layout.positions );
+	arrays.normals = (const float*)( data + layout.normals );
+	arrays.texCoords = (const float*)( data + layout.texCoords );
+	arrays.indices = (const uint32_t*)( data + layout.indices );
+	arrays.groups = (const uint32_t*)( data + layout.groups );
+
+	arrays.groupNames.clear();
+	const char *name = (const char*)( data + layout.groupNames );
+	const char *namesEnd = name + h->groupNamesSize;
+	while ( name < namesEnd && (uint32_t)arrays.groupNames.size() < h->groupCount ) {
+		arrays.groupNames.emplace_back( name );
+		name += arrays.groupNames.back().size() + 1;
+	}
+
+	// 壊れた番号で配列の外を読まないように一通り見ておく
+	bool valid = arrays.groupNames.size() == h->groupCount;
+	for ( uint32_t i = 0; valid && i < arrays.triangleCount; i++ ) {
+		valid = arrays.groups[i] < h->groupCount
+			&& arrays.indices[i * 3 + 0] < arrays.vertexCount
+			&& arrays.indices[i * 3 + 1] < arrays.vertexCount
+			&& arrays.indices[i * 3 + 2] < arrays.vertexCount;
+	}
+	if ( !valid ) {
+		close();
+		return false;
+	}
+
+	header = *h;
+	return true;
+}
+
+void MeshCache::close() {
+	file.close();
+	arrays = MeshArrays();
+}
+
+bool MeshCache::getBVH( BVHBuildMethod method, std::vector<LinearBVHNode> *nodes, std::vector<uint32_t> *primitiveIndices ) const {
+	if ( !isOpen() || header.bvhMethod != (int32_t)method || header.bvhNodeCount == 0 ) { return false; }
+
+	const Layout layout( header.vertexCount, header.triangleCount, header.groupNamesSize, header.bvhNodeCount, header.bvhPrimitiveCount );
+	if ( layout.end > file.getSize() ) { return false; }
+	const uint8_t *data = file.getData();
+	nodes->resize( header.bvhNodeCount );
+	memcpy( (void*)nodes->data(), data + layout.bvhNodes, header.bvhNodeCount * sizeof( LinearBVHNode ) );
+	primitiveIndices->resize( header.bvhPrimitiveCount );
+	memcpy( primitiveIndices->data(), data + layout.bvhPrimitives, header.bvhPrimitiveCount * sizeof( uint32_t ) );
+
+	// 子は親より後ろに並んでいるはず. そうでなければ輪になって走査が終わらない
+	// 前から順に深さを伝えて, 走査のスタックに収まらない木も使わない
+	const int nodeCount = (int)header.bvhNodeCount;
+	std::vector<int> depths( nodeCount, 0 );
+	for ( int i = 0; i < nodeCount; i++ ) {
+		const LinearBVHNode &node = ( *nodes )[i];
+		if ( node.primitiveCount > 0 ) {
+			if ( node.primitivesOffset < 0 || (int64_t)node.primitivesOffset + node.primitiveCount > header.bvhPrimitiveCount ) { return false; }
+			continue;
+		}
+		if ( i + 1 >= nodeCount || node.secondChildOffset <= i || node.secondChildOffset >= nodeCount ) { return false; }
+		if ( depths[i] + 2 > BVH::maxStackSize ) { return false; }
+		depths[i + 1] = max( depths[i + 1], depths[i] + 1 );
+		depths[node.secondChildOffset] = max( depths[node.secondChildOffset], depths[i] + 1 );
+	}
+	for ( uint32_t index : *primitiveIndices ) {
+		if ( index >= header.triangleCount ) { return false; }
+	}
+	return true;
+}
+
+bool MeshCache::write( const std::string &cacheFile, const std::string &sourceFile, const MeshArrays &arrays ) {
+	MeshCacheHeader h = {};
+	memcpy( h.magic, magic, sizeof( magic ) );
+	h.version = version;
+	if ( !getFileStatus( sourceFile, &h.sourceSize, &h.sourceTime ) ) { return false; }
+	h.vertexCount = arrays.vertexCount;
+	h.triangleCount = arrays.triangleCount;
+	h.groupCount = (uint32_t)arrays.groupNames.size();
+	std::string groupNames;
+	for ( const auto &name : arrays.groupNames ) {
+		groupNames += name;
+		groupNames += '\0';
+	}
+	h.groupNamesSize = (uint32_t)groupNames.size();
+	h.bvhMethod = -1;
+
+	std::ofstream ofs( cacheFile, std::ios::binary | std::ios::trunc );
+	if ( !ofs ) { return false; }
+
+	const Layout layout( h.vertexCount, h.triangleCount, h.groupNamesSize, 0, 0 );
+	writeAt( ofs, 0, &h, sizeof( h ) );
+	writeAt( ofs, layout.positions, arrays.positions, h.vertexCount * 3 * sizeof( float ) );
+	writeAt( ofs, layout.normals, arrays.normals, h.vertexCount * 3 * sizeof( float ) );
+	writeAt( ofs, layout.texCoords, arrays.texCoords, h.vertexCount * 2 * sizeof( float ) );
+	writeAt( ofs, layout.indices, arrays.indices, h.triangleCount * 3 * sizeof( uint32_t ) );
+	writeAt( ofs, layout.groups, arrays.groups, h.triangleCount * sizeof( uint32_t ) );
+	writeAt( ofs, layout.groupNames, groupNames.data(), groupNames.size() );
+	return (bool)ofs;
+}
+
+bool MeshCache::writeBVH( const std::string &cacheFile, BVHBuildMethod method, const std::vector<LinearBVHNode> &nodes, const std::vector<uint32_t> &primitiveIndices ) {
+	std::fstream fs( cacheFile, std::ios::binary | std::ios::in | std::ios::out );
+	if ( !fs ) { return false; }
+
+	MeshCacheHeader h;
+	fs.read( (char*)&h, sizeof( h ) );
+	if ( !fs || memcmp( h.magic, magic, sizeof( magic ) ) != 0 || h.version != version ) { return false; }
+
+	// 先に BVH なしにしておけば, 途中で止まっても壊れた BVH は読まない
+	h.bvhMethod = -1;
+	writeAt( fs, 0, &h, sizeof( h ) );
+	fs.flush();
+
+	h.bvhNodeCount = (uint32_t)nodes.size();
+	h.bvhPrimitiveCount = (uint32_t)primitiveIndices.size();
+	const Layout layout( h.vertexCount, h.triangleCount, h.groupNamesSize, h.bvhNodeCount, h.bvhPrimitiveCount );
+	writeAt( fs, layout.bvhNodes, nodes.data(), nodes.size() * sizeof( LinearBVHNode ) );
+	writeAt( fs, layout.bvhPrimitives, primitiveIndices.data(), primitiveIndices.size() * sizeof( uint32_t ) );
+	fs.flush();
+
+	h.bvhMethod = (int32_t)method;
+	writeAt( fs, 0, &h, sizeof( h ) );
+	return (bool)fs;
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include "General.h"
+#include "ObjectStructure.h"
+#include "MappedFile.h"
+
+#include <string>
+
+// メッシュの頂点と三角形を配列で並べたもの. OBJ から作っても, キャッシュを写したものを指してもよい
+struct MeshArrays {
+	uint32_t vertexCount = 0;
+	uint32_t triangleCount = 0;
+	const float *positions = nullptr; // 頂点ごとに xyz
+	const float *normals = nullptr;   // 頂点ごとに xyz. vn が無ければ 0
+	const float *texCoords = nullptr; // 頂点ごとに uv
+	const uint32_t *indices = nullptr; // 三角形ごとに頂点番号 3 つ
+	const uint32_t *groups = nullptr;  // 三角形ごとに groupNames の番号
+	std::vector<std::string> groupNames; // OBJ のオブジェクト名. マテリアルはこれで決める
+};
+
+// 形を変えたら MeshCache.cpp の version を上げる
+struct MeshCacheHeader {
+	char magic[4];
+	uint32_t version;
+	uint64_t sourceSize;
+	int64_t sourceTime;
+	uint32_t vertexCount;
+	uint32_t triangleCount;
+	uint32_t groupCount;
+	uint32_t groupNamesSize;   // 名前を '\0' 区切りで並べたバイト数
+	int32_t bvhMethod;         // BVH が無ければ -1
+	uint32_t bvhNodeCount;
+	uint32_t bvhPrimitiveCount;
+	uint32_t pad;
+};
+
+// OBJ を読んだ結果をそのまま並べたバイナリのキャッシュ. 次からは読まずに写して使う
+// 元のファイルの大きさと更新時刻を覚えておいて, 変わっていたら使わない
+// 後ろに二分木の BVH (LinearBVHNode の配列と三角形の並び) も 1 つだけ置ける. BVH4 もこれを潰して作る
+class MeshCache {
+public:
+	// 元のファイルが変わっていなければ写して true
+	bool open( const std::string &cacheFile, const std::string &sourceFile );
+	void close();
+	bool isOpen() const { return file.getData() != nullptr; }
+
+	// 写したところを指すので close するまで使える
+	const MeshArrays& getArrays() const { return arrays; }
+	// method で作った BVH が入っていれば true
+	bool getBVH( BVHBuildMethod method, std::vector<LinearBVHNode> *nodes, std::vector<uint32_t> *primitiveIndices ) const;
+
+	static bool write( const std::string &cacheFile, const std::string &sourceFile, const MeshArrays &arrays );
+	// write したファイルの後ろに BVH を書く. 前に入っていた BVH は置き換える. 写している間は呼ばない
+	static bool writeBVH( const std::string &cacheFile, BVHBuildMethod method, const std::vector<LinearBVHNode> &nodes, const std::vector<uint32_t> &primitiveIndices );
+
+private:
+	MappedFile file;
+	// 開いたときに写しておく. 同じファイルを開いた別の MeshCache が writeBVH で書き換えても, 写した範囲の外は読まない
+	MeshCacheHeader header;
+	MeshArrays arrays;
+};
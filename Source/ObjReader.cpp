@@ -0,0 +1,456 @@
+#include "ObjReader.h"
+#include "MappedFile.h"
+
+#include <omp.h>
+#include <cstring>
+#include <atomic>
+#include <algorithm>
+#include <unordered_map>
+
+namespace {
+
+const size_t minChunkSize = 1 << 20;
+const int32_t missing = INT32_MIN;
+
+// 面の角の v/vt/vn の番号. relative のビットが立っているものは区切りの中で数えた番号なので, 後で区切りの先頭の番号を足す
+struct Corner {
+	int32_t index[3]; // v, vt, vn. 書いていなければ missing
+	uint8_t relative;
+};
+
+// 区切り 1 つぶんを読んだもの. 頂点は OBJ に書いてある順のまま
+struct Chunk {
+	std::vector<float> positions;
+	std::vector<float> texCoords;
+	std::vector<float> normals;
+	std::vector<Corner> corners; // 三角形ごとに 3 つ
+	std::vector<std::pair<uint32_t, std::string>> groupStarts; // この番号の三角形からこの名前
+	std::string error;
+};
+
+// 区切りの中身が, 全部つないだ配列のどこから始まるか. 頂点と角の数で数える
+struct ChunkOffsets {
+	int64_t positions = 0;
+	int64_t texCoords = 0;
+	int64_t normals = 0;
+	int64_t corners = 0;
+};
+
+inline bool isSpace( char c ) { return c == ' ' || c == '\t' || c == '\r'; }
+inline bool isDigit( char c ) { return c >= '0' && c <= '9'; }
+
+const char* skipSpaces( const char *p, const char *end ) {
+	while ( p < end && isSpace( *p ) ) { p++; }
+	return p;
+}
+
+// strtof の代わり. ロケールを見ない. 仮数は 19 桁まで整数で持って, 最後に 10 の冪を掛ける
+const char* parseFloat( const char *p, const char *end, float *value ) {
+	static const double powers[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+
+	bool negative = false;
+	if ( p < end && ( *p == '-' || *p == '+' ) ) {
+		negative = *p == '-';
+		p++;
+	}
+
+	uint64_t mantissa = 0;
+	int significant = 0;
+	int exponent = 0;
+	bool hasDigits = false;
+	for ( ; p < end && isDigit( *p ); p++ ) {
+		if ( significant < 19 ) {
+			mantissa = mantissa * 10 + ( *p - '0' );
+			significant += mantissa != 0;
+		} else {
+			exponent++;
+		}
+		hasDigits = true;
+	}
+	if ( p < end && *p == '.' ) {
+		for ( p++; p < end && isDigit( *p ); p++ ) {
+			if ( significant < 19 ) {
+				mantissa = mantissa * 10 + ( *p - '0' );
+				significant += mantissa != 0;
+				exponent--;
+			}
+			hasDigits = true;
+		}
+	}
+	if ( !hasDigits ) { return nullptr; }
+
+	if ( p < end && ( *p == 'e' || *p == 'E' ) ) {
+		p++;
+		bool negativeExponent = false;
+		if ( p < end && ( *p == '-' || *p == '+' ) ) {
+			negativeExponent = *p == '-';
+			p++;
+		}
+		if ( p == end || !isDigit( *p ) ) { return nullptr; }
+		int e = 0;
+		for ( ; p < end && isDigit( *p ); p++ ) {
+			e = min( e * 10 + ( *p - '0' ), 10000 ); // 大きすぎるものは inf か 0 になれば十分
+		}
+		exponent += negativeExponent ? -e : e;
+	}
+
+	double v = (double)mantissa;
+	if ( exponent < 0 ) {
+		v = -exponent <= 22 ? v / powers[-exponent] : v * pow( 10.0, exponent );
+	} else if ( exponent > 0 ) {
+		v = exponent <= 22 ? v * powers[exponent] : v * pow( 10.0, exponent );
+	}
+	*value = (float)( negative ? -v : v );
+	return p;
+}
+
+const char* parseInt( const char *p, const char *end, int64_t *value ) {
+	bool negative = false;
+	if ( p < end && ( *p == '-' || *p == '+' ) ) {
+		negative = *p == '-';
+		p++;
+	}
+	if ( p == end || !isDigit( *p ) ) { return nullptr; }
+	int64_t v = 0;
+	for ( ; p < end && isDigit( *p ); p++ ) {
+		if ( v <= INT32_MAX ) { v = v * 10 + ( *p - '0' ); }
+	}
+	*value = negative ? -v : v;
+	return p;
+}
+
+// 数字を count 個まで読んで values に足す. required 個より少なければ失敗
+bool parseFloats( const char *p, const char *end, int required, int count, std::vector<float> *values ) {
+	for ( int i = 0; i < count; i++ ) {
+		p = skipSpaces( p, end );
+		float v = 0.0f;
+		if ( p == end && i >= required ) {
+			values->push_back( 0.0f );
+			continue;
+		}
+		p = parseFloat( p, end, &v );
+		if ( p == nullptr ) { return false; }
+		values->push_back( v );
+	}
+	return true;
+}
+
+// 1 始まりの番号を 0 始まりに. 負なら後ろから数える (区切りの中の番号になる)
+bool resolveIndex( int64_t index, int64_t localCount, int k, Corner *corner ) {
+	if ( index > INT32_MAX || index < -(int64_t)INT32_MAX ) { return false; }
+	if ( index > 0 ) {
+		corner->index[k] = (int32_t)( index - 1 );
+	} else if ( index < 0 ) {
+		corner->index[k] = (int32_t)( localCount + index );
+		corner->relative |= 1 << k;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+// v, v/vt, v//vn, v/vt/vn
+const char* parseCorner( const char *p, const char *end, const Chunk &chunk, Corner *corner ) {
+	const int64_t counts[3] = { (int64_t)chunk.positions.size() / 3, (int64_t)chunk.texCoords.size() / 2, (int64_t)chunk.normals.size() / 3 };
+	corner->index[0] = corner->index[1] = corner->index[2] = missing;
+	corner->relative = 0;
+	for ( int k = 0; k < 3; k++ ) {
+		if ( k > 0 ) {
+			if ( p == end || *p != '/' ) { break; }
+			p++;
+			if ( k == 1 && p < end && *p == '/' ) { continue; }
+		}
+		int64_t index;
+		p = parseInt( p, end, &index );
+		if ( p == nullptr || !resolveIndex( index, counts[k], k, corner ) ) { return nullptr; }
+	}
+	return p;
+}
+
+bool parseLine( const char *p, const char *end, Chunk *chunk, std::vector<Corner> *polygon ) {
+	p = skipSpaces( p, end );
+	if ( p == end || *p == '#' ) { return true; }
+
+	const char *keyword = p;
+	while ( p < end && !isSpace( *p ) ) { p++; }
+	const size_t length = p - keyword;
+	auto is = [&]( const char *name ) { return length == strlen( name ) && memcmp( keyword, name, length ) == 0; };
+
+	if ( is( "v" ) ) {
+		return parseFloats( p, end, 3, 3, &chunk->positions );
+	}
+	if ( is( "vt" ) ) {
+		return parseFloats( p, end, 1, 2, &chunk->texCoords );
+	}
+	if ( is( "vn" ) ) {
+		return parseFloats( p, end, 3, 3, &chunk->normals );
+	}
+	if ( is( "f" ) ) {
+		polygon->clear();
+		while ( true ) {
+			p = skipSpaces( p, end );
+			if ( p == end ) { break; }
+			Corner corner;
+			p = parseCorner( p, end, *chunk, &corner );
+			if ( p == nullptr ) { return false; }
+			polygon->push_back( corner );
+		}
+		if ( polygon->size() < 3 ) { return false; }
+		for ( size_t i = 1; i + 1 < polygon->size(); i++ ) {
+			chunk->corners.push_back( ( *polygon )[0] );
+			chunk->corners.push_back( ( *polygon )[i] );
+			chunk->corners.push_back( ( *polygon )[i + 1] );
+		}
+		return true;
+	}
+	if ( is( "o" ) || is( "g" ) ) {
+		p = skipSpaces( p, end );
+		const char *nameEnd = end;
+		while ( nameEnd > p && isSpace( nameEnd[-1] ) ) { nameEnd--; }
+		chunk->groupStarts.emplace_back( (uint32_t)( chunk->corners.size() / 3 ), std::string( p, nameEnd ) );
+		return true;
+	}
+	return true;
+}
+
+void parseChunk( const char *begin, const char *end, Chunk *chunk ) {
+	std::vector<Corner> polygon;
+	for ( const char *p = begin; p < end; ) {
+		const char *lineEnd = (const char*)memchr( p, '\n', end - p );
+		if ( lineEnd == nullptr ) { lineEnd = end; }
+		if ( !parseLine( p, lineEnd, chunk, &polygon ) ) {
+			chunk->error = std::string( p, lineEnd - p < 80 ? lineEnd : p + 80 );
+			return;
+		}
+		p = lineEnd + 1;
+	}
+}
+
+};
+
+MeshArrays ObjData::getArrays() const {
+	MeshArrays arrays;
+	arrays.vertexCount = (uint32_t)( positions.size() / 3 );
+	arrays.triangleCount = (uint32_t)groups.size();
+	arrays.positions = positions.data();
+	arrays.normals = normals.data();
+	arrays.texCoords = texCoords.data();
+	arrays.indices = indices.data();
+	arrays.groups = groups.data();
+	arrays.groupNames = groupNames;
+	return arrays;
+}
+
+bool readObjFile( const std::string &filename, ObjData *data ) {
+	MappedFile file;
+	if ( !file.open( filename ) ) {
+		fprintf( stderr, "Cannot open %s\n", filename.c_str() );
+		return false;
+	}
+	const char *begin = (const char*)file.getData();
+	const char *end = begin + file.getSize();
+
+	// 行の途中で切らないように, 区切りの終わりは次の改行の後ろまでずらす
+	const int chunkCount = clamp( (int)( file.getSize() / minChunkSize ), 1, omp_get_max_threads() * 4 );
+	std::vector<const char*> bounds( chunkCount + 1 );
+	bounds[0] = begin;
+	for ( int i = 1; i < chunkCount; i++ ) {
+		const char *p = begin + file.getSize() * i / chunkCount;
+		if ( p < bounds[i - 1] ) { p = bounds[i - 1]; }
+		const char *newline = (const char*)memchr( p, '\n', end - p );
+		bounds[i] = newline ? newline + 1 : end;
+	}
+	bounds[chunkCount] = end;
+
+	std::vector<Chunk> chunks( chunkCount );
+#pragma omp parallel for schedule(dynamic, 1)
+	for ( int i = 0; i < chunkCount; i++ ) {
+		parseChunk( bounds[i], bounds[i + 1], &chunks[i] );
+	}
+	for ( const auto &chunk : chunks ) {
+		if ( !chunk.error.empty() ) {
+			fprintf( stderr, "%s: cannot parse \"%s\"\n", filename.c_str(), chunk.error.c_str() );
+			return false;
+		}
+	}
+
+	// 区切りの大きさを足していって, つないだ配列の中で区切りが始まる場所を決める
+	std::vector<ChunkOffsets> offsets( chunkCount + 1 );
+	for ( int i = 0; i < chunkCount; i++ ) {
+		offsets[i + 1].positions = offsets[i].positions + (int64_t)chunks[i].positions.size() / 3;
+		offsets[i + 1].texCoords = offsets[i].texCoords + (int64_t)chunks[i].texCoords.size() / 2;
+		offsets[i + 1].normals = offsets[i].normals + (int64_t)chunks[i].normals.size() / 3;
+		offsets[i + 1].corners = offsets[i].corners + (int64_t)chunks[i].corners.size();
+	}
+	const ChunkOffsets &total = offsets[chunkCount];
+	if ( total.positions > INT32_MAX || total.corners > INT32_MAX ) {
+		fprintf( stderr, "%s: too many vertices or faces\n", filename.c_str() );
+		return false;
+	}
+	const int64_t counts[3] = { total.positions, total.texCoords, total.normals };
+
+	// 区切りごとに自分の場所へ写して, 区切りの中の番号をファイル全体の番号に直す
+	std::vector<float> positions( total.positions * 3 );
+	std::vector<float> texCoords( total.texCoords * 2 );
+	std::vector<float> normals( total.normals * 3 );
+	std::vector<Corner> corners( total.corners );
+	bool valid = true;
+#pragma omp parallel for schedule(dynamic, 1) reduction(&&:valid)
+	for ( int i = 0; i < chunkCount; i++ ) {
+		Chunk &chunk = chunks[i];
+		std::copy( chunk.positions.begin(), chunk.positions.end(), positions.begin() + offsets[i].positions * 3 );
+		std::copy( chunk.texCoords.begin(), chunk.texCoords.end(), texCoords.begin() + offsets[i].texCoords * 2 );
+		std::copy( chunk.normals.begin(), chunk.normals.end(), normals.begin() + offsets[i].normals * 3 );
+
+		const int64_t bases[3] = { offsets[i].positions, offsets[i].texCoords, offsets[i].normals };
+		Corner *out = corners.data() + offsets[i].corners;
+		for ( const auto &corner : chunk.corners ) {
+			*out = corner;
+			for ( int k = 0; k < 3; k++ ) {
+				if ( corner.index[k] == missing ) { continue; }
+				const int64_t index = corner.index[k] + ( ( corner.relative >> k ) & 1 ? bases[k] : 0 );
+				if ( index < 0 || index >= counts[k] ) {
+					valid = false;
+					continue;
+				}
+				out->index[k] = (int32_t)index;
+			}
+			out++;
+		}
+
+		// 写したものはもう使わない
+		std::vector<float>().swap( chunk.positions );
+		std::vector<float>().swap( chunk.texCoords );
+		std::vector<float>().swap( chunk.normals );
+		std::vector<Corner>().swap( chunk.corners );
+	}
+	if ( !valid ) {
+		fprintf( stderr, "%s: face index out of range\n", filename.c_str() );
+		return false;
+	}
+
+	// 同じ v/vt/vn の角は 1 つの頂点にする. v ごとにそれを使う角を集めて, v ごとに別々にまとめる
+	const int positionCount = (int)total.positions;
+	const int cornerCount = (int)total.corners;
+	std::vector<uint32_t> cornerStarts( positionCount + 1, 0 ); // v ごとの角の並びの先頭
+#pragma omp parallel for
+	for ( int c = 0; c < cornerCount; c++ ) {
+#pragma omp atomic
+		cornerStarts[corners[c].index[0] + 1]++;
+	}
+	for ( int p = 0; p < positionCount; p++ ) {
+		cornerStarts[p + 1] += cornerStarts[p];
+	}
+
+	std::vector<uint32_t> cornerLists( cornerCount );
+	{
+		std::vector<std::atomic<uint32_t>> cursors( positionCount );
+#pragma omp parallel for
+		for ( int p = 0; p < positionCount; p++ ) {
+			cursors[p].store( cornerStarts[p], std::memory_order_relaxed );
+		}
+#pragma omp parallel for
+		for ( int c = 0; c < cornerCount; c++ ) {
+			cornerLists[cursors[corners[c].index[0]].fetch_add( 1, std::memory_order_relaxed )] = c;
+		}
+	}
+
+	*data = ObjData();
+	data->indices.resize( cornerCount );
+
+	// v ごとに角を vt, vn で並べれば同じ組は隣り合う. まず v の中での頂点の番号を振って, v ごとの頂点の数を数える
+	auto sameVertex = [&]( uint32_t a, uint32_t b ) {
+		return corners[a].index[1] == corners[b].index[1] && corners[a].index[2] == corners[b].index[2];
+	};
+	std::vector<uint32_t> vertexStarts( positionCount + 1, 0 );
+#pragma omp parallel for schedule(dynamic, 1024)
+	for ( int p = 0; p < positionCount; p++ ) {
+		uint32_t *begin = cornerLists.data() + cornerStarts[p];
+		uint32_t *end = cornerLists.data() + cornerStarts[p + 1];
+		std::sort( begin, end, [&]( uint32_t a, uint32_t b ) {
+			const Corner &ca = corners[a], &cb = corners[b];
+			return ca.index[1] != cb.index[1] ? ca.index[1] < cb.index[1] : ca.index[2] < cb.index[2];
+		} );
+		uint32_t vertexCount = 0;
+		for ( uint32_t *c = begin; c < end; c++ ) {
+			if ( c == begin || !sameVertex( c[-1], c[0] ) ) { vertexCount++; }
+			data->indices[*c] = vertexCount - 1;
+		}
+		vertexStarts[p + 1] = vertexCount;
+	}
+	for ( int p = 0; p < positionCount; p++ ) {
+		vertexStarts[p + 1] += vertexStarts[p];
+	}
+
+	// 頂点の数が決まったので, 同じ頂点の最初の角から中身を書く
+	const uint32_t vertexCount = vertexStarts[positionCount];
+	data->positions.resize( (size_t)vertexCount * 3 );
+	data->texCoords.resize( (size_t)vertexCount * 2 );
+	data->normals.resize( (size_t)vertexCount * 3 );
+#pragma omp parallel for schedule(dynamic, 1024)
+	for ( int p = 0; p < positionCount; p++ ) {
+		for ( uint32_t i = cornerStarts[p]; i < cornerStarts[p + 1]; i++ ) {
+			const uint32_t c = cornerLists[i];
+			const uint32_t v = vertexStarts[p] + data->indices[c];
+			data->indices[c] = v;
+			if ( i > cornerStarts[p] && sameVertex( cornerLists[i - 1], c ) ) { continue; }
+
+			const int32_t t = corners[c].index[1];
+			const int32_t n = corners[c].index[2];
+			std::copy( &positions[(size_t)p * 3], &positions[(size_t)p * 3] + 3, &data->positions[(size_t)v * 3] );
+			if ( t != missing ) {
+				std::copy( &texCoords[(size_t)t * 2], &texCoords[(size_t)t * 2] + 2, &data->texCoords[(size_t)v * 2] );
+			}
+			if ( n != missing ) {
+				std::copy( &normals[(size_t)n * 3], &normals[(size_t)n * 3] + 3, &data->normals[(size_t)v * 3] );
+			}
+		}
+	}
+
+	// グループの名前に番号を振るのは名前の出てきた順なので, 区切りの順に 1 つずつ. 三角形に書くのは並列で
+	std::unordered_map<std::string, uint32_t> groupIds;
+	uint32_t group = 0;
+	bool hasGroup = false;
+	auto setGroup = [&]( const std::string &name ) {
+		auto it = groupIds.find( name );
+		if ( it == groupIds.end() ) {
+			it = groupIds.emplace( name, (uint32_t)data->groupNames.size() ).first;
+			data->groupNames.push_back( name );
+		}
+		group = it->second;
+		hasGroup = true;
+	};
+	std::vector<uint32_t> firstGroups( chunkCount );
+	std::vector<std::vector<std::pair<uint32_t, uint32_t>>> groupChanges( chunkCount ); // この番号の三角形からこのグループ
+	for ( int i = 0; i < chunkCount; i++ ) {
+		const auto &starts = chunks[i].groupStarts;
+		const uint32_t triangleCount = (uint32_t)( ( offsets[i + 1].corners - offsets[i].corners ) / 3 );
+		size_t next = 0;
+		while ( next < starts.size() && starts[next].first == 0 ) {
+			setGroup( starts[next++].second );
+		}
+		// 最初の o, g より前の面は ""
+		if ( !hasGroup && triangleCount > 0 ) { setGroup( "" ); }
+		firstGroups[i] = group;
+		for ( ; next < starts.size(); next++ ) {
+			setGroup( starts[next].second );
+			groupChanges[i].emplace_back( starts[next].first, group );
+		}
+	}
+
+	data->groups.resize( cornerCount / 3 );
+#pragma omp parallel for schedule(dynamic, 1)
+	for ( int i = 0; i < chunkCount; i++ ) {
+		const uint32_t begin = (uint32_t)( offsets[i].corners / 3 );
+		const uint32_t triangleCount = (uint32_t)( ( offsets[i + 1].corners - offsets[i].corners ) / 3 );
+		uint32_t g = firstGroups[i];
+		size_t next = 0;
+		for ( uint32_t t = 0; t < triangleCount; t++ ) {
+			while ( next < groupChanges[i].size() && groupChanges[i][next].first <= t ) {
+				g = groupChanges[i][next++].second;
+			}
+			data->groups[begin + t] = g;
+		}
+	}
+	return true;
+}
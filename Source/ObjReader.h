@@ -0,0 +1,25 @@
+#pragma once
+
+#include "General.h"
+#include "MeshCache.h"
+
+#include <string>
+
+// OBJ を読んだ結果. v/vt/vn の組が同じ角は 1 つの頂点にまとめてある
+struct ObjData {
+	std::vector<float> positions;
+	std::vector<float> normals;
+	std::vector<float> texCoords;
+	std::vector<uint32_t> indices;
+	std::vector<uint32_t> groups;
+	std::vector<std::string> groupNames; // o か g の名前. 最初の o, g より前の面は ""
+
+	// 中を指すだけなので, この ObjData があるうちだけ使える
+	MeshArrays getArrays() const;
+};
+
+// v, vt, vn, f, o, g だけを見る. mtllib, usemtl などは読み飛ばす
+// 多角形は扇形に三角形に分ける. vn の無い角は法線を 0 にしておく (TriangleMesh が面の法線を使う)
+// そうしておけば v/vt が同じ角は面が違っても 1 つの頂点にまとまる
+// ファイルを写して行の切れ目で区切り, 区切りごとに別スレッドで読む
+bool readObjFile( const std::string &filename, ObjData *data );
@@ -1,46 +1,359 @@
 #include "ObjectStructure.h"
+#include "BVH4.h"
+#include "Stats.h"
 
-void BVHIterator::findNextObject() {
-	auto pickShallowerNode = [&]() {
-		if ( !objStack.empty() ) {
-			currentNode = objStack.top();
-			objStack.pop();
+void abortOnTraversalStackOverflow() {
+	fprintf( stderr, "BVH traversal stack overflow\n" );
+	abort();
+}
+
+std::shared_ptr<ObjectStructure> buildObjectStructure( const spvector<Object> &objects, ObjectStructureType type, BVHBuildMethod method ) {
+	if ( type == ObjectStructureType::BVH4 ) {
+		return std::make_shared<BVH4>( objects, method );
+	}
+	return std::make_shared<BVH>( objects, method );
+}
+
+bool ObjectStructure::intersect( const Ray &ray, Hit *hit, const std::shared_ptr<ObjectStructureIteratorHistory> &history, std::shared_ptr<ObjectStructureIteratorHistory> *newHistory ) {
+	bool found = false;
+
+	const PrecomputedRay precomputed( ray );
+	auto it = traverse( ray, history );
+	for ( ; !it->end(); it->next() ) {
+		if ( ( *( *it ) )->intersect( ray, precomputed, hit ) ) {
+			found = true;
+			it->select( *hit );
+		}
+	}
+	if ( newHistory != nullptr ) {
+		*newHistory = it->getHistory();
+	}
+
+	return found;
+}
+
+bool ObjectStructure::occluded( const Ray &ray, float tMax ) {
+	const PrecomputedRay precomputed( ray );
+	for ( auto it = traverse( ray, nullptr ); !it->end(); it->next() ) {
+		if ( ( *( *it ) )->occluded( ray, precomputed, tMax ) ) { return true; }
+	}
+	return false;
+}
+
+bool BVH::intersect( const Ray &ray, Hit *hit, const std::shared_ptr<ObjectStructureIteratorHistory> &history, std::shared_ptr<ObjectStructureIteratorHistory> *newHistory ) {
+	int selectedNode = -1;
+	const PrecomputedRay precomputed( ray );
+	int nodesVisited = 0;
+	int primitiveTests = 0;
+
+	auto intersectLeaf = [&]( int index ) {
+		const LinearBVHNode &node = nodes[index];
+		primitiveTests += node.primitiveCount;
+		const int end = node.primitivesOffset + node.primitiveCount;
+		if ( triangleMesh != nullptr ) {
+			for ( int i = node.primitivesOffset; i < end; i++ ) {
+				if ( triangleMesh->intersect( i, precomputed, hit ) ) {
+					selectedNode = index;
+				}
+			}
 			return;
-		} else {
-			if ( auto parent = currentLocalRootNode->parent.lock() ) {
-				lastLocalIndex = currentLocalRootNode->localIndex;
-				currentLocalRootNode = parent;
-				currentNode = parent->children[lastLocalIndex == 0 ? 1 : 0];
-				return;
-			} else {
-				currentNode = nullptr;
-				return;
+		}
+		for ( int i = node.primitivesOffset; i < end; i++ ) {
+			if ( primitives[i]->intersect( ray, precomputed, hit ) ) {
+				selectedNode = index;
 			}
 		}
 	};
 
-	if ( currentNode->object != nullptr ) {
-		pickShallowerNode();
-		if ( currentNode == nullptr ) { return; }
-	}
-
-	while ( true ) {
-		auto intsct = currentNode->aabb.getIntersection( ray );
-		if ( intsct && ( !maxT || *intsct < *maxT ) ) {
-			if ( currentNode->object != nullptr ) {
-				return;
-			} else {
-				if ( lastLocalIndex == 0 ) {
-					objStack.push( currentNode->children[1] );
-					currentNode = currentNode->children[0];
-				} else {
-					objStack.push( currentNode->children[0] );
-					currentNode = currentNode->children[1];
+	if ( !nodes.empty() ) {
+		// 前回当たった葉から先に調べて tMax を早めに縮める
+		int historyNode = history != nullptr ? std::static_pointer_cast<BVHIteratorHistory>( history )->lastSelectedNode : -1;
+		if ( historyNode >= 0 ) {
+			intersectLeaf( historyNode );
+		}
+
+		int nodeStack[maxStackSize];
+		int stackSize = 0;
+		int index = 0;
+		while ( true ) {
+			const LinearBVHNode &node = nodes[index];
+			nodesVisited++;
+			float tNear, tFar;
+			if ( node.aabb.getIntersection( precomputed, 0.0f, hit->t, &tNear, &tFar ) ) {
+				if ( node.primitiveCount == 0 ) {
+					// 分割軸の向きで近い方の子を先に辿る
+					if ( stackSize >= maxStackSize ) { abortOnTraversalStackOverflow(); }
+					if ( precomputed.sign[node.axis] ) {
+						nodeStack[stackSize++] = index + 1;
+						index = node.secondChildOffset;
+					} else {
+						nodeStack[stackSize++] = node.secondChildOffset;
+						index = index + 1;
+					}
+					continue;
+				}
+				if ( index != historyNode ) {
+					intersectLeaf( index );
+				}
+			}
+			if ( stackSize == 0 ) { break; }
+			index = nodeStack[--stackSize];
+		}
+	}
+
+	if ( newHistory != nullptr ) {
+		*newHistory = std::make_shared<BVHIteratorHistory>( selectedNode );
+	}
+
+	Stats::add( StatCounter::NodesVisited, nodesVisited );
+	Stats::add( StatCounter::BoxTests, nodesVisited );
+	Stats::add( StatCounter::PrimitiveTests, primitiveTests );
+
+	return selectedNode >= 0;
+}
+
+bool BVH::occluded( const Ray &ray, float tMax ) {
+	if ( nodes.empty() ) { return false; }
+
+	// 当たりさえすればいいので子の順番は気にしない
+	const PrecomputedRay precomputed( ray );
+	int nodeStack[maxStackSize];
+	int stackSize = 0;
+	nodeStack[stackSize++] = 0;
+	int nodesVisited = 0;
+	int primitiveTests = 0;
+	bool found = false;
+	while ( stackSize > 0 && !found ) {
+		const int index = nodeStack[--stackSize];
+		const LinearBVHNode &node = nodes[index];
+		nodesVisited++;
+		float tNear, tFar;
+		if ( !node.aabb.getIntersection( precomputed, 0.0f, tMax, &tNear, &tFar ) ) { continue; }
+
+		if ( node.primitiveCount > 0 ) {
+			for ( int i = node.primitivesOffset; i < node.primitivesOffset + node.primitiveCount; i++ ) {
+				primitiveTests++;
+				if ( triangleMesh != nullptr ? triangleMesh->occluded( i, precomputed, tMax ) : primitives[i]->occluded( ray, precomputed, tMax ) ) {
+					found = true;
+					break;
 				}
 			}
-		} else {
-			pickShallowerNode();
-			if ( currentNode == nullptr ) { return; }
+			continue;
 		}
+
+		if ( stackSize + 2 > maxStackSize ) { abortOnTraversalStackOverflow(); }
+		nodeStack[stackSize++] = node.secondChildOffset;
+		nodeStack[stackSize++] = index + 1;
 	}
+
+	Stats::add( StatCounter::NodesVisited, nodesVisited );
+	Stats::add( StatCounter::BoxTests, nodesVisited );
+	Stats::add( StatCounter::PrimitiveTests, primitiveTests );
+	return found;
+}
+
+BVHIterator::BVHIterator( std::shared_ptr<BVH> objectStructure, const Ray& ray, std::shared_ptr<ObjectStructureIteratorHistory> history )
+	: maxT( std::numeric_limits<float>::infinity() ), objectStructure( objectStructure ), ray( ray ), nodes( objectStructure->getNodes().data() ), primitives( &objectStructure->getPrimitives() ) {
+
+	selectedNode = -1;
+	historyNode = -1;
+	currentNode = -1;
+	stackSize = 0;
+	if ( objectStructure->getNodes().empty() ) { return; }
+
+	nodeStack[stackSize++] = 0;
+
+	if ( history != nullptr && std::static_pointer_cast<BVHIteratorHistory>( history )->lastSelectedNode >= 0 ) {
+		// 前回当たった葉から先に調べて maxT を早めに縮める
+		historyNode = std::static_pointer_cast<BVHIteratorHistory>( history )->lastSelectedNode;
+		currentNode = historyNode;
+		currentPrimitive = nodes[historyNode].primitivesOffset;
+		primitiveEnd = currentPrimitive + nodes[historyNode].primitiveCount;
+	} else {
+		findNextObject();
+	}
+}
+
+void BVHIterator::findNextObject() {
+	if ( currentNode >= 0 && ++currentPrimitive < primitiveEnd ) { return; }
+
+	while ( stackSize > 0 ) {
+		int index = nodeStack[--stackSize];
+		const LinearBVHNode &node = nodes[index];
+
+		float tNear, tFar;
+		if ( !node.aabb.getIntersection( ray, 0.0f, maxT, &tNear, &tFar ) ) { continue; }
+
+		if ( node.primitiveCount > 0 ) {
+			if ( index == historyNode ) { continue; }
+			currentNode = index;
+			currentPrimitive = node.primitivesOffset;
+			primitiveEnd = node.primitivesOffset + node.primitiveCount;
+			return;
+		}
+
+		if ( stackSize + 2 > maxStackSize ) { abortOnTraversalStackOverflow(); }
+		nodeStack[stackSize++] = node.secondChildOffset;
+		nodeStack[stackSize++] = index + 1;
+	}
+
+	currentNode = -1;
+}
+
+namespace {
+struct Bin {
+	AABB aabb;
+	int count;
+};
+}
+
+std::shared_ptr<BVHNode> BVH::buildBVHBinned( std::vector<AABBObj>::iterator begin, const std::vector<AABBObj>::iterator &end, const std::shared_ptr<BVHNode> &node, int depth ) {
+	const int objNum = (int)( end - begin );
+
+	if ( objNum == 1 ) {
+		node->primitives.push_back( begin->second );
+		node->aabb = begin->first;
+		return node;
+	}
+
+	// 上の方の階層は同時に走っている部分木が少ないので, 余っているスレッドで走査を分担する
+	const int threadCount = getBuildThreadCount();
+	const int chunkCount = objNum >= parallelBinningThreshold ? max( 1, threadCount >> depth ) : 1;
+	const int chunkSize = ( objNum + chunkCount - 1 ) / chunkCount;
+
+	std::vector<AABB> chunkAABBs( chunkCount );
+	std::vector<AABB> chunkCentroidAABBs( chunkCount );
+#pragma omp parallel for num_threads( chunkCount ) if( chunkCount > 1 )
+	for ( int c = 0; c < chunkCount; c++ ) {
+		const int first = c * chunkSize;
+		const int last = min( objNum, first + chunkSize );
+		if ( first >= last ) { continue; }
+		AABB aabb = begin[first].first;
+		AABB centroidAABB{ begin[first].first.center(), begin[first].first.center() };
+		for ( int i = first + 1; i < last; i++ ) {
+			aabb |= begin[i].first;
+			Vector3 center = begin[i].first.center();
+			centroidAABB.min = min( centroidAABB.min, center );
+			centroidAABB.max = max( centroidAABB.max, center );
+		}
+		chunkAABBs[c] = aabb;
+		chunkCentroidAABBs[c] = centroidAABB;
+	}
+	AABB aabb = chunkAABBs[0];
+	AABB centroidAABB = chunkCentroidAABBs[0];
+	for ( int c = 1; c < chunkCount && c * chunkSize < objNum; c++ ) {
+		aabb |= chunkAABBs[c];
+		centroidAABB |= chunkCentroidAABBs[c];
+	}
+	node->aabb = aabb;
+
+	auto makeLeaf = [&]() {
+		node->primitives.reserve( objNum );
+		for ( auto it = begin; it != end; it++ ) { node->primitives.push_back( it->second ); }
+		return node;
+	};
+
+	if ( depth >= maxDepth && objNum <= std::numeric_limits<uint16_t>::max() ) {
+		return makeLeaf();
+	}
+
+	float binScale[3];
+	for ( int axis = 0; axis < 3; axis++ ) {
+		const float extent = centroidAABB.max[axis] - centroidAABB.min[axis];
+		binScale[axis] = extent > 0.0f ? binCount / extent : 0.0f;
+	}
+	auto binIndex = [&]( const Vector3 &center, int axis ) {
+		return min( binCount - 1, (int)( ( center[axis] - centroidAABB.min[axis] ) * binScale[axis] ) );
+	};
+
+	// 3 軸分のビンをチャンクごとに作ってから足し合わせる
+	std::vector<Bin> chunkBins( chunkCount * 3 * binCount );
+#pragma omp parallel for num_threads( chunkCount ) if( chunkCount > 1 )
+	for ( int c = 0; c < chunkCount; c++ ) {
+		Bin *bins = &chunkBins[c * 3 * binCount];
+		for ( int b = 0; b < 3 * binCount; b++ ) { bins[b].count = 0; }
+		const int last = min( objNum, ( c + 1 ) * chunkSize );
+		for ( int i = c * chunkSize; i < last; i++ ) {
+			const AABB &objAABB = begin[i].first;
+			const Vector3 center = objAABB.center();
+			for ( int axis = 0; axis < 3; axis++ ) {
+				Bin &bin = bins[axis * binCount + binIndex( center, axis )];
+				bin.aabb = bin.count == 0 ? objAABB : ( bin.aabb | objAABB );
+				bin.count++;
+			}
+		}
+	}
+	Bin *bins = &chunkBins[0];
+	for ( int c = 1; c < chunkCount; c++ ) {
+		for ( int b = 0; b < 3 * binCount; b++ ) {
+			const Bin &bin = chunkBins[c * 3 * binCount + b];
+			if ( bin.count == 0 ) { continue; }
+			bins[b].aabb = bins[b].count == 0 ? bin.aabb : ( bins[b].aabb | bin.aabb );
+			bins[b].count += bin.count;
+		}
+	}
+
+	// コストは走査 1, 交差判定 1 として親の表面積で正規化
+	const float T_AABB = 1.0f;
+	const float T_tri = 1.0f;
+	const float invArea = 1.0f / max( aabb.surfaceArea(), 1e-20f );
+
+	int bestAxis = -1;
+	int bestSplit = 0;
+	float bestCost = 0.0f;
+	for ( int axis = 0; axis < 3; axis++ ) {
+		if ( binScale[axis] == 0.0f ) { continue; }
+		const Bin *axisBins = &bins[axis * binCount];
+
+		// 右から累積した表面積 * 個数
+		float rightCost[binCount];
+		AABB right;
+		int rightCount = 0;
+		for ( int i = binCount - 1; i > 0; i-- ) {
+			if ( axisBins[i].count > 0 ) {
+				right = rightCount == 0 ? axisBins[i].aabb : ( right | axisBins[i].aabb );
+				rightCount += axisBins[i].count;
+			}
+			rightCost[i] = rightCount > 0 ? right.surfaceArea() * rightCount : 0.0f;
+		}
+
+		AABB left;
+		int leftCount = 0;
+		for ( int i = 0; i < binCount - 1; i++ ) {
+			if ( axisBins[i].count > 0 ) {
+				left = leftCount == 0 ? axisBins[i].aabb : ( left | axisBins[i].aabb );
+				leftCount += axisBins[i].count;
+			}
+			if ( leftCount == 0 || leftCount == objNum ) { continue; }
+			float cost = T_AABB + ( left.surfaceArea() * leftCount + rightCost[i + 1] ) * invArea * T_tri;
+			if ( bestAxis == -1 || cost < bestCost ) {
+				bestAxis = axis;
+				bestSplit = i + 1;
+				bestCost = cost;
+			}
+		}
+	}
+
+	if ( objNum <= maxPrimitivesInLeaf && ( bestAxis == -1 || objNum * T_tri <= bestCost ) ) {
+		return makeLeaf();
+	}
+
+	std::vector<AABBObj>::iterator mid;
+	if ( bestAxis == -1 || depth >= maxDepth ) {
+		// 重心が全部同じ位置か, 深くなりすぎて葉に入りきらない. 半分ずつに分けるしかない
+		mid = begin + objNum / 2;
+		node->axis = 0;
+	} else {
+		mid = std::partition( begin, end, [&]( const AABBObj &obj ) { return binIndex( obj.first.center(), bestAxis ) < bestSplit; } );
+		node->axis = bestAxis;
+	}
+
+	node->children[0] = std::make_shared<BVHNode>();
+	node->children[1] = std::make_shared<BVHNode>();
+
+	parallelInvoke( objNum >= parallelTaskThreshold && depth < getTaskDepth(),
+		[&]() { buildBVHBinned( begin, mid, node->children[0], depth + 1 ); },
+		[&]() { buildBVHBinned( mid, end, node->children[1], depth + 1 ); } );
+
+	return node;
 }
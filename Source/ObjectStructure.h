@@ -2,12 +2,17 @@
 
 #include "General.h"
 #include "Geometry.h"
-#include "Mesh.h"
+
+#include <future>
+#include <thread>
 
 
 class ObjectStructure;
 class BVH;
 
+// 走査のスタックが溢れたら木が壊れている. リリースでも止める
+[[noreturn]] void abortOnTraversalStackOverflow();
+
 
 struct ObjectStructureIteratorHistory {
 };
@@ -17,12 +22,26 @@ public:
 	virtual std::shared_ptr<PrimitiveObject> operator*() const = 0;
 	virtual ObjectStructureIterator& next() = 0;
 	virtual bool end() const = 0;
-	virtual void select(const Intersection& intersection) = 0;
+	virtual void select(const Hit& hit) = 0;
 	virtual std::shared_ptr<ObjectStructureIteratorHistory> getHistory() = 0;
 };
 class ObjectStructure {
 public:
 	virtual std::shared_ptr<ObjectStructureIterator> traverse(const Ray& ray, std::shared_ptr<ObjectStructureIteratorHistory> history) = 0;
+
+	// hit->t より手前で一番近い交差を探して hit を書き換える. 見つかれば true
+	virtual bool intersect(const Ray& ray, Hit *hit, const std::shared_ptr<ObjectStructureIteratorHistory> &history = nullptr, std::shared_ptr<ObjectStructureIteratorHistory> *newHistory = nullptr);
+
+	// tMax より手前に何かあれば true. どれか 1 つ見つかった時点で打ち切る
+	virtual bool occluded(const Ray& ray, float tMax);
+
+	// tMax より手前で一番近い交差
+	std::optional<Intersection> getIntersection(const Ray& ray, const std::shared_ptr<ObjectStructureIteratorHistory> &history = nullptr, std::shared_ptr<ObjectStructureIteratorHistory> *newHistory = nullptr, float tMax = std::numeric_limits<float>::infinity()) {
+		Hit hit;
+		hit.t = tMax;
+		if (!intersect(ray, &hit, history, newHistory)) { return std::nullopt; }
+		return hit.getIntersection(ray);
+	}
 };
 
 class NaiveObjectStructureIterator : public ObjectStructureIterator {
@@ -32,7 +51,7 @@ public:
 	virtual std::shared_ptr<PrimitiveObject> operator*() const { return *iterator; }
 	virtual ObjectStructureIterator& next() { ++iterator; return *this; }
 	virtual bool end() const { return iterator == end_iterator; }
-	virtual void select(const Intersection& intersection) {}
+	virtual void select(const Hit& hit) {}
 	virtual std::shared_ptr<ObjectStructureIteratorHistory> getHistory() { return nullptr; }
 private:
 	spvector<PrimitiveObject>::iterator iterator;
@@ -45,101 +64,217 @@ public:
 private:
 	spvector<PrimitiveObject> objects;
 };
+enum class ObjectStructureType {
+	BVH,  // 二分木
+	BVH4, // 4 分木 (SSE)
+};
 
-
+enum class BVHBuildMethod {
+	SAHSweep,  // 全分割候補をソートして総当たり
+	BinnedSAH, // 重心をビンに分けて近似
+};
 
 struct BVHNode {
 	AABB aabb;
-	std::weak_ptr<BVHNode> parent;
-	int localIndex; // g̐eɑ΂q̒ł̃CfbNX
-	std::shared_ptr<PrimitiveObject> object;
+	int axis;
+	std::vector<uint32_t> primitives; // 空でなければ葉. 作るときに渡したものの番号
 	std::shared_ptr<BVHNode> children[2];
 };
 
+// 走査用に BVHNode を深さ優先順で配列に詰めたもの
+// 1 つ目の子は自身の直後に置くので 2 つ目の子のオフセットだけ持つ
+struct alignas(32) LinearBVHNode {
+	AABB aabb;
+	union {
+		int primitivesOffset;  // 葉
+		int secondChildOffset; // 内部ノード
+	};
+	uint16_t primitiveCount; // 0 なら内部ノード
+	uint8_t axis;
+	uint8_t pad;
+};
+static_assert(sizeof(LinearBVHNode) == 32, "LinearBVHNode must be 32 bytes");
+
 struct BVHIteratorHistory : public ObjectStructureIteratorHistory {
-	BVHIteratorHistory(std::shared_ptr<BVHNode> lastSelectedNode) : lastSelectedNode(lastSelectedNode) {}
-	std::shared_ptr<BVHNode> lastSelectedNode;
+	BVHIteratorHistory(int lastSelectedNode) : lastSelectedNode(lastSelectedNode) {}
+	int lastSelectedNode;
 };
 
 class BVHIterator : public ObjectStructureIterator {
 public:
-	BVHIterator(std::shared_ptr<BVH> objectStructure, std::shared_ptr<BVHNode> node, const Ray& ray, std::shared_ptr<ObjectStructureIteratorHistory> history)
-		: objectStructure(objectStructure), currentNode(node), ray(ray) {
-
-		if (history != nullptr && std::static_pointer_cast<BVHIteratorHistory>(history)->lastSelectedNode != nullptr) {
-			currentLocalRootNode = std::static_pointer_cast<BVHIteratorHistory>(history)->lastSelectedNode;
-			currentNode = currentLocalRootNode;
-		}
-		else {
-			currentLocalRootNode = node;
-			findNextObject();
-		}
-		lastLocalIndex = 0;
-	}
-	virtual std::shared_ptr<PrimitiveObject> operator*() const { return currentNode->object; }
+	BVHIterator(std::shared_ptr<BVH> objectStructure, const Ray& ray, std::shared_ptr<ObjectStructureIteratorHistory> history);
+	virtual std::shared_ptr<PrimitiveObject> operator*() const { return (*primitives)[currentPrimitive]; }
 	virtual ObjectStructureIterator& next() { findNextObject(); return *this; }
-	virtual bool end() const { return currentNode == nullptr; }
-	virtual void select(const Intersection& intersection) {
+	virtual bool end() const { return currentNode < 0; }
+	virtual void select(const Hit& hit) {
 		selectedNode = currentNode;
-		maxT = intersection.t;
+		maxT = hit.t;
 	}
 	virtual std::shared_ptr<ObjectStructureIteratorHistory> getHistory() { return std::make_shared<BVHIteratorHistory>(selectedNode); }
 private:
+	static const int maxStackSize = 64;
 
 	void findNextObject();
 
-	std::optional<float> maxT;
-	std::shared_ptr<BVHNode> currentNode;
-	std::shared_ptr<BVHNode> selectedNode;
-	std::stack<std::shared_ptr<BVHNode>> objStack;
-	Ray ray;
+	float maxT;
+	int currentNode;
+	int currentPrimitive;
+	int primitiveEnd;
+	int selectedNode;
+	int historyNode;
+	int nodeStack[maxStackSize];
+	int stackSize;
 	std::shared_ptr<BVH> objectStructure;
-
-	int lastLocalIndex;
-	std::shared_ptr<BVHNode> currentLocalRootNode;
-
+	PrecomputedRay ray;
+	const LinearBVHNode *nodes;
+	const spvector<PrimitiveObject> *primitives;
 };
 
 class BVH : public ObjectStructure, public std::enable_shared_from_this<BVH> {
 public:
-	using AABBObj = std::pair<AABB, std::shared_ptr<Object>>;
+	using AABBObj = std::pair<AABB, uint32_t>; // 箱と, 作るときに渡したものの番号
 
-	BVH(const spvector<Object> &objects) {
-		std::vector<AABBObj> aabbObjects;
-		aabbObjects.reserve(objects.size());
-		for (auto &obj : objects) { aabbObjects.push_back(std::make_pair(obj->getAABB(), obj)); }
-		node = std::make_shared<BVHNode>();
-		node->localIndex = 0;
-		buildBVH(aabbObjects.begin(), aabbObjects.end(), node);
+	BVH(const spvector<Object> &objects, BVHBuildMethod method = BVHBuildMethod::BinnedSAH) {
+		std::vector<AABB> aabbs;
+		aabbs.reserve(objects.size());
+		for (auto &obj : objects) { aabbs.push_back(obj->getAABB()); }
+		build(aabbs, method);
+
+		primitives.reserve(primitiveIndices.size());
+		for (uint32_t index : primitiveIndices) { primitives.push_back(std::static_pointer_cast<PrimitiveObject>(objects[index])); }
+	}
+	// メッシュの三角形を番号で指す BVH. 葉の順に三角形が並ぶように mesh の方を並べ替える
+	BVH(const std::shared_ptr<TriangleMesh> &mesh, BVHBuildMethod method = BVHBuildMethod::BinnedSAH) : triangleMesh(mesh) {
+		std::vector<AABB> aabbs(mesh->getTriangleCount());
+		for (uint32_t i = 0; i < mesh->getTriangleCount(); i++) { aabbs[i] = mesh->getAABB(i); }
+		build(aabbs, method);
+		mesh->reorder(primitiveIndices);
+	}
+	// 作って詰めたものをそのまま使う. キャッシュから読んだとき用. primitiveIndices は元の三角形の番号
+	BVH(std::vector<LinearBVHNode> nodes, std::vector<uint32_t> primitiveIndices, const std::shared_ptr<TriangleMesh> &mesh)
+		: nodes(std::move(nodes)), primitiveIndices(std::move(primitiveIndices)), triangleMesh(mesh) {
+		mesh->reorder(this->primitiveIndices);
 	}
-	virtual std::shared_ptr<ObjectStructureIterator> traverse(const Ray& ray, std::shared_ptr<ObjectStructureIteratorHistory> history) { return std::make_shared<BVHIterator>(shared_from_this(), node, ray, history); }
+	// メッシュの BVH の三角形は PrimitiveObject ではないので返せない. メッシュでは intersect, occluded だけを使う
+	virtual std::shared_ptr<ObjectStructureIterator> traverse(const Ray& ray, std::shared_ptr<ObjectStructureIteratorHistory> history) {
+		assert(triangleMesh == nullptr);
+		if (triangleMesh != nullptr) { return std::make_shared<NaiveObjectStructureIterator>(primitives); } // 空
+		return std::make_shared<BVHIterator>(shared_from_this(), ray, history);
+	}
+	virtual bool intersect(const Ray& ray, Hit *hit, const std::shared_ptr<ObjectStructureIteratorHistory> &history = nullptr, std::shared_ptr<ObjectStructureIteratorHistory> *newHistory = nullptr);
+	virtual bool occluded(const Ray& ray, float tMax);
+
+	// 走査のスタックの大きさ. キャッシュから読んだ木もこれに収まるか見る
+	static const int maxStackSize = 64;
 
-	std::shared_ptr<BVHNode> getRootNode() { return node; }
+	const std::vector<LinearBVHNode>& getNodes() const { return nodes; }
+	const spvector<PrimitiveObject>& getPrimitives() const { return primitives; }
+	// 葉に並べた順に, 作るときに渡したものの番号
+	const std::vector<uint32_t>& getPrimitiveIndices() const { return primitiveIndices; }
+	// メッシュの BVH ならその三角形. 葉の i 番目は三角形 i
+	const std::shared_ptr<const TriangleMesh>& getTriangleMesh() const { return triangleMesh; }
 
 private:
-	std::shared_ptr<BVHNode> node;
+	static const int binCount = 32;
+	static const int maxPrimitivesInLeaf = 4;
+	static const int maxDepth = 44; // これより深くは SAH で分けない. 葉にするか, 入りきらなければ半分ずつに分ける
+	// 半分ずつに分けると 2^32 個でも 17 段で葉に入る. 走査のスタックはこれで足りる
+	static_assert(maxDepth + 17 < maxStackSize, "BVH can be deeper than the traversal stack");
+	static const int parallelTaskThreshold = 4096;
+	static const int parallelBinningThreshold = 1 << 15;
+
+	std::vector<LinearBVHNode> nodes;
+	std::vector<uint32_t> primitiveIndices;
+	spvector<PrimitiveObject> primitives;           // triangleMesh が無いとき. 葉の順
+	std::shared_ptr<const TriangleMesh> triangleMesh;
+
+	void build(const std::vector<AABB> &aabbs, BVHBuildMethod method) {
+		std::vector<AABBObj> aabbObjects;
+		aabbObjects.reserve(aabbs.size());
+		for (uint32_t i = 0; i < (uint32_t)aabbs.size(); i++) { aabbObjects.push_back(std::make_pair(aabbs[i], i)); }
+		if (aabbObjects.empty()) { return; }
+
+		// 木を作ってから配列に詰め直す. 木自体は走査に使わないので捨てる
+		auto root = std::make_shared<BVHNode>();
+		if (method == BVHBuildMethod::BinnedSAH) {
+			buildBVHBinned(aabbObjects.begin(), aabbObjects.end(), root, 0);
+		}
+		else {
+			buildBVH(aabbObjects.begin(), aabbObjects.end(), root);
+		}
+		nodes.reserve(aabbObjects.size() * 2);
+		primitiveIndices.reserve(aabbObjects.size());
+		flattenBVH(root, 0);
+	}
 
-	std::shared_ptr<BVHNode> buildBVH(std::vector<AABBObj>::iterator begin, const std::vector<AABBObj>::iterator &end, const std::shared_ptr<BVHNode> &node) {
+	int flattenBVH(const std::shared_ptr<BVHNode> &node, int depth) {
+		assert(depth < maxStackSize);
 
-		if (end - begin == 1) {
-			if (auto mesh = std::dynamic_pointer_cast<MeshInstance>(begin->second)) {
-				auto meshBVHNode = std::static_pointer_cast<BVH>(mesh->buildObjectStructure())->getRootNode();
+		int nodeIndex = (int)nodes.size();
+		nodes.emplace_back();
+		nodes[nodeIndex].aabb = node->aabb;
+		nodes[nodeIndex].pad = 0;
 
-				if (auto parent = node->parent.lock()) {
-					parent->children[node->localIndex] = meshBVHNode;
-					meshBVHNode->parent = parent;
-				}
-				return meshBVHNode;
-			}
-			else {
-				node->object = std::static_pointer_cast<PrimitiveObject>(begin->second);
-				node->aabb = node->object->getAABB();
-			}
+		if (!node->primitives.empty()) {
+			nodes[nodeIndex].primitivesOffset = (int)primitiveIndices.size();
+			nodes[nodeIndex].primitiveCount = (uint16_t)node->primitives.size();
+			nodes[nodeIndex].axis = 0;
+			primitiveIndices.insert(primitiveIndices.end(), node->primitives.begin(), node->primitives.end());
+		}
+		else {
+			flattenBVH(node->children[0], depth + 1);
+			int secondChildOffset = flattenBVH(node->children[1], depth + 1);
+			nodes[nodeIndex].secondChildOffset = secondChildOffset;
+			nodes[nodeIndex].primitiveCount = 0;
+			nodes[nodeIndex].axis = (uint8_t)node->axis;
+		}
+		return nodeIndex;
+	}
+
+	static int getBuildThreadCount() {
+		static const int threadCount = max(1, (int)std::thread::hardware_concurrency());
+		return threadCount;
+	}
+	// 部分木を別スレッドに投げる深さ. コア数の数倍くらいのタスクができるところまで
+	static int getTaskDepth() {
+		static const int taskDepth = (int)ceilf(log2f((float)getBuildThreadCount())) + 2;
+		return taskDepth;
+	}
+	// OpenMP 2.0 には task が無いので std::async で代わりにする
+	template <class F0, class F1>
+	static void parallelInvoke(bool parallel, const F0 &f0, const F1 &f1) {
+		if (!parallel) {
+			f0();
+			f1();
+			return;
+		}
+		auto task = std::async(std::launch::async, f0);
+		f1();
+		task.get();
+	}
+
+	std::shared_ptr<BVHNode> buildBVHBinned(std::vector<AABBObj>::iterator begin, const std::vector<AABBObj>::iterator &end, const std::shared_ptr<BVHNode> &node, int depth);
+
+	std::shared_ptr<BVHNode> buildBVH(std::vector<AABBObj>::iterator begin, const std::vector<AABBObj>::iterator &end, const std::shared_ptr<BVHNode> &node, int depth = 0) {
+
+		if (end - begin == 1) {
+			node->primitives.push_back(begin->second);
+			node->aabb = begin->first;
 			return node;
 		}
 
 		int bestIndex;
-		{
+		if (depth >= maxDepth) {
+			node->aabb = begin->first;
+			for (auto it = begin; it != end; it++) { node->aabb |= it->first; }
+			if (end - begin <= std::numeric_limits<uint16_t>::max()) {
+				for (auto it = begin; it != end; it++) { node->primitives.push_back(it->second); }
+				return node;
+			}
+			bestIndex = (int)(end - begin) / 2;
+			node->axis = 0;
+		}
+		else {
 			int bestAxis = -1;
 			float bestSAH;
 			AABB aabb1;
@@ -183,9 +318,9 @@ private:
 				return A(aabb1) * objNum1 + A(aabb2) * objNum2;
 			};
 
-			// TODO : ċA̍Œɉx\[gKvȂ
+			// TODO : 再帰の最中に何度もソートし直す必要ない
 
-			aabb1 = xSortedObjs[0].second->getAABB();
+			aabb1 = xSortedObjs[0].first;
 			aabb2.push(xSortedObjs.rbegin()->first);
 			for (auto it = xSortedObjs.rbegin()+1; it != xSortedObjs.rend()-1; it++) { aabb2.push(aabb2.top() | it->first); }
 			for (int i = 1; i < xSortedObjs.size(); i++) {
@@ -199,7 +334,7 @@ private:
 				aabb2.pop();
 			}
 
-			aabb1 = ySortedObjs[0].second->getAABB();
+			aabb1 = ySortedObjs[0].first;
 			aabb2.push(ySortedObjs.rbegin()->first);
 			for (auto it = ySortedObjs.rbegin() + 1; it != ySortedObjs.rend() - 1; it++) { aabb2.push(aabb2.top() | it->first); }
 			for (int i = 1; i < ySortedObjs.size(); i++) {
@@ -213,7 +348,7 @@ private:
 				aabb2.pop();
 			}
 
-			aabb1 = zSortedObjs[0].second->getAABB();
+			aabb1 = zSortedObjs[0].first;
 			aabb2.push(zSortedObjs.rbegin()->first);
 			for (auto it = zSortedObjs.rbegin() + 1; it != zSortedObjs.rend() - 1; it++) { aabb2.push(aabb2.top() | it->first); }
 			for (int i = 1; i < zSortedObjs.size(); i++) {
@@ -229,23 +364,18 @@ private:
 
 			auto &bestSortedObjs = bestAxis == 0 ? xSortedObjs : (bestAxis == 1 ? ySortedObjs : zSortedObjs);
 			std::copy(bestSortedObjs.begin(), bestSortedObjs.end(), begin);
+			node->axis = bestAxis;
 		}
 
 		node->children[0] = std::make_shared<BVHNode>();
 		node->children[1] = std::make_shared<BVHNode>();
 
-		node->children[0]->parent = node;
-		node->children[1]->parent = node;
-		node->children[0]->localIndex = 0;
-		node->children[1]->localIndex = 1;
-
-		buildBVH(begin, begin + bestIndex, node->children[0]);
-		buildBVH(begin + bestIndex, end, node->children[1]);
+		parallelInvoke(end - begin >= parallelTaskThreshold && depth < getTaskDepth(),
+			[&]() { buildBVH(begin, begin + bestIndex, node->children[0], depth + 1); },
+			[&]() { buildBVH(begin + bestIndex, end, node->children[1], depth + 1); });
 
 		return node;
 	}
 };
 
-inline std::shared_ptr<ObjectStructure> buildObjectStructure(const spvector<Object> objects) {
-	return std::make_shared<BVH>(objects);
-}
\ No newline at end of file
+std::shared_ptr<ObjectStructure> buildObjectStructure(const spvector<Object> &objects, ObjectStructureType type = ObjectStructureType::BVH, BVHBuildMethod method = BVHBuildMethod::BinnedSAH);
\ No newline at end of file
@@ -5,59 +5,153 @@
 #include "Scene.h"
 #include "Material.h"
 #include "ObjectStructure.h"
+#include "Sampler.h"
+#include "Stats.h"
 
 float PathTracer::russianRouretteProbability;
 float PathTracer::originOffset;
+float LightSamplingPathTracer::shadowRayEpsilon = 0.0001f;
 
-void PathTracer::evalRadiance( std::shared_ptr<Scene> scene, Ray *ray, std::shared_ptr<ObjectStructureIteratorHistory> history ) {
+void PathTracer::setBounceDimension( Sampler &sampler, const Ray &ray, int offset ) {
+	static_assert( LightDimension - BSDFDimension == Material::maxSampleDimensions, "BSDF dimensions do not match the material" );
+	sampler.setDimension( 1 + ( ray.depth - 1 ) * DimensionsPerBounce + offset );
+}
+
+void PathTracer::advanceRay( Ray *ray, const Vector3 &d, const Vector3 &p, const Intersection &intersection ) {
+	const Vector3 prevD = ray->d;
+	ray->d = d;
+	ray->o = p + d * originOffset;
+	ray->depth++;
 
-	if ( ray->depth > 1 && randf() > russianRouretteProbability ) {
-		ray->radiance = Vector3( 0.0f );
-		return;
+	if ( intersection.object && dot( prevD, intersection.n ) * dot( d, intersection.n ) > 0.0f ) {
+		if ( dot( d, intersection.n ) < 0.0f ) {
+			ray->media.push( intersection.material->participatingMedia.get() );
+		} else {
+			if ( !ray->media.empty() ) {
+				ray->media.pop();
+			} else {
+				// おかしい
+			}
+		}
 	}
+}
 
-	auto intersection = scene->getIntersection( *ray, history, &history );
+Vector3 BSDFSamplingPathTracer::evalRadiance( std::shared_ptr<Scene> scene, const Ray &cameraRay, Sampler &sampler ) {
+	Vector3 radiance( 0.0f );
+	Vector3 throughput( 1.0f );
+	Ray ray = cameraRay;
+	std::shared_ptr<ObjectStructureIteratorHistory> history;
 
-	if ( intersection ) {
-		evalRadiance( scene, ray, *intersection, history );
-	} else {
-		ray->radiance = Vector3( 0.0f );
-	}
-	if ( ray->depth > 1 ) {
-		*ray->radiance /= russianRouretteProbability;
+	while ( true ) {
+		if ( ray.depth > 1 ) {
+			setBounceDimension( sampler, ray, RussianRouletteDimension );
+			if ( sampler.get1D() > russianRouretteProbability ) { break; }
+			throughput /= russianRouretteProbability;
+		}
+
+		setBounceDimension( sampler, ray, MediaDistanceDimension );
+		auto intersection = scene->getIntersection( ray, history, &history, &sampler );
+		if ( !intersection ) { break; }
+
+		radiance += throughput * intersection->material->getEmission();
+
+		setBounceDimension( sampler, ray, BSDFDimension );
+		auto bsdfSample = intersection->material->sampleRay( ray, *intersection, scene, history, sampler );
+		throughput *= clampPositive( bsdfSample.bsdf_cos_divided_p );
+		if ( throughput.x <= 0.0f && throughput.y <= 0.0f && throughput.z <= 0.0f ) { break; }
+
+		advanceRay( &ray, bsdfSample.d, bsdfSample.p, *intersection );
 	}
+
+	Stats::addPathLength( ray.depth );
+	return radiance;
 }
 
-Ray PathTracer::generateNextRay( const Ray &prev, const Vector3 &d, const Vector3 &p, const Intersection &intersection ) {
-	Ray next;
-	next.d = d;
-	next.o = p + d * originOffset;
-	next.depth = prev.depth + 1;
-	next.media = prev.media;
+Vector3 LightSamplingPathTracer::evalRadiance( std::shared_ptr<Scene> scene, const Ray &cameraRay, Sampler &sampler ) {
+	Vector3 radiance( 0.0f );
+	Vector3 throughput( 1.0f );
+	Ray ray = cameraRay;
+	std::shared_ptr<ObjectStructureIteratorHistory> history;
 
-	if ( intersection.object && dot( prev.d, intersection.n ) * dot( next.d, intersection.n ) > 0.0f ) {
-		if ( dot( next.d, intersection.n ) < 0.0f ) {
-			next.media.push( intersection.material->participatingMedia );
-		} else {
-			if ( !next.media.empty() ) {
-				next.media.pop();
-			} else {
-				// 
+	// 直前の頂点で光源サンプリングしていたら, BSDF サンプリングで光源に当たったぶんを MIS で割り引く
+	float prevPdf = 0.0f;
+	Vector3 prevP;
+	Vector3 prevN;
+
+	while ( true ) {
+		if ( ray.depth > 1 ) {
+			setBounceDimension( sampler, ray, RussianRouletteDimension );
+			if ( sampler.get1D() > russianRouretteProbability ) { break; }
+			throughput /= russianRouretteProbability;
+		}
+
+		setBounceDimension( sampler, ray, MediaDistanceDimension );
+		auto intersection = scene->getIntersection( ray, history, &history, &sampler );
+		if ( !intersection ) { break; }
+
+		const Vector3 emission = intersection->material->getEmission();
+		if ( emission.x > 0.0f || emission.y > 0.0f || emission.z > 0.0f ) {
+			float weight = 1.0f;
+			const float lightPdfArea = prevPdf > 0.0f ? scene->getLightPdf( prevP, prevN, intersection->object.get() ) : 0.0f;
+			if ( lightPdfArea > 0.0f ) {
+				const Vector3 toLight = intersection->p - prevP;
+				const float distSq = toLight.lengthSq();
+				const float cosLight = fabsf( dot( intersection->n, toLight ) ) / sqrtf( distSq );
+				if ( cosLight > 0.0f ) {
+					weight = powerHeuristic( prevPdf, lightPdfArea * distSq / cosLight );
+				}
 			}
+			radiance += throughput * emission * weight;
+		}
+
+		setBounceDimension( sampler, ray, BSDFDimension );
+		auto bsdfSample = intersection->material->sampleRay( ray, *intersection, scene, history, sampler );
+
+		setBounceDimension( sampler, ray, LightDimension );
+		const float uLight = sampler.get1D();
+		const Vector2 uPoint = sampler.get2D();
+
+		// 鏡面, 媒質中の散乱, 媒質の中から当たった面では光源サンプリングしない
+		const bool insideMedia = !ray.media.empty() && ray.media.top() != nullptr;
+		prevPdf = 0.0f;
+		if ( bsdfSample.pdf > 0.0f && intersection->object != nullptr && !insideMedia ) {
+			radiance += throughput * sampleDirectLight( scene, *intersection, bsdfSample, uLight, uPoint );
+			prevPdf = bsdfSample.pdf;
+			prevP = bsdfSample.p;
+			prevN = bsdfSample.n;
 		}
+
+		throughput *= clampPositive( bsdfSample.bsdf_cos_divided_p );
+		if ( throughput.x <= 0.0f && throughput.y <= 0.0f && throughput.z <= 0.0f ) { break; }
+
+		advanceRay( &ray, bsdfSample.d, bsdfSample.p, *intersection );
 	}
 
-	return std::move( next );
+	Stats::addPathLength( ray.depth );
+	return radiance;
 }
 
-void BSDFSamplingPathTracer::evalRadiance( std::shared_ptr<Scene> scene, Ray *ray, const Intersection &intersection, std::shared_ptr<ObjectStructureIteratorHistory> history ) {
-	ray->radiance = Vector3( 0.0f );
-	auto bsdfSample = intersection.material->sampleRay( *ray, intersection, scene, history );
-	Ray out = generateNextRay( *ray, bsdfSample.d, bsdfSample.p, intersection );
+Vector3 LightSamplingPathTracer::sampleDirectLight( const std::shared_ptr<Scene> &scene, const Intersection &intersection, const SampledRay &sample, float uLight, const Vector2 &uPoint ) {
+	LightSample light;
+	if ( !scene->sampleLight( sample.p, sample.n, uLight, uPoint, &light ) ) { return Vector3( 0.0f ); }
 
-	PathTracer::evalRadiance( scene, &out, history );
-	*ray->radiance += clampPositive( *out.radiance * bsdfSample.bsdf_cos_divided_p );
-	*ray->radiance += intersection.material->getEmission();
-}
+	const Vector3 toLight = light.point.p - sample.p;
+	const float distSq = toLight.lengthSq();
+	const float dist = sqrtf( distSq );
+	const Vector3 o = toLight / dist;
+	const float cosLight = fabsf( dot( light.point.n, o ) );
+	if ( cosLight <= 0.0f ) { return Vector3( 0.0f ); }
+
+	float bsdfPdf;
+	const Vector3 f = intersection.material->evalBSDFCos( intersection, sample, o, &bsdfPdf );
+	if ( f.x <= 0.0f && f.y <= 0.0f && f.z <= 0.0f ) { return Vector3( 0.0f ); }
 
+	Ray shadowRay;
+	shadowRay.o = sample.p + o * originOffset;
+	shadowRay.d = o;
+	shadowRay.depth = 0;
+	if ( scene->occluded( shadowRay, dist * ( 1.0f - shadowRayEpsilon ) ) ) { return Vector3( 0.0f ); }
 
+	const float lightPdf = light.pdf * distSq / cosLight;
+	return clampPositive( f * light.emission * ( powerHeuristic( lightPdf, bsdfPdf ) / lightPdf ) );
+}
@@ -5,20 +5,52 @@ struct ObjectStructureIteratorHistory;
 class ExplicitLight;
 struct Intersection;
 struct Ray;
+struct SampledRay;
+class Sampler;
 
 class PathTracer {
 public:
 	static float russianRouretteProbability;
 	static float originOffset;
 
-	virtual void evalRadiance ( std::shared_ptr<Scene> scene, Ray *ray, std::shared_ptr<ObjectStructureIteratorHistory> history = nullptr );
+	// カメラから出たレイが運んでくる放射輝度
+	virtual Vector3 evalRadiance( std::shared_ptr<Scene> scene, const Ray &ray, Sampler &sampler ) = 0;
 
 protected:
-	Ray generateNextRay(const Ray &ray, const Vector3 &d, const Vector3 &p, const Intersection &intersection);
-	virtual void evalRadiance( std::shared_ptr<Scene> scene, Ray *ray, const Intersection &intersection, std::shared_ptr<ObjectStructureIteratorHistory> history = nullptr ) = 0;
+	// 1 回のバウンスで使う次元の割り当て. 頂点ごとに決まった次元から配るので, 材質や分岐で使う数が違っても次の頂点はずれない
+	enum BounceDimension {
+		RussianRouletteDimension,
+		MediaDistanceDimension,
+		BSDFDimension,
+		LightDimension = BSDFDimension + 3, // Material::maxSampleDimensions
+		LightPointDimension,
+		DimensionsPerBounce,
+	};
+	// ray の頂点で使う次元 offset に sampler を合わせる. カメラが 0 次元目を使うので 1 から
+	static void setBounceDimension( Sampler &sampler, const Ray &ray, int offset );
+
+	// ray をその場で次の方向に進める. 媒質の出入りもここで積む
+	void advanceRay( Ray *ray, const Vector3 &d, const Vector3 &p, const Intersection &intersection );
 };
 
 class BSDFSamplingPathTracer : public PathTracer{
-protected:
-	virtual void evalRadiance( std::shared_ptr<Scene> scene, Ray *ray, const Intersection &intersection, std::shared_ptr<ObjectStructureIteratorHistory> history = nullptr );
+public:
+	virtual Vector3 evalRadiance( std::shared_ptr<Scene> scene, const Ray &ray, Sampler &sampler );
+};
+
+// 各頂点で明示的な光源を 1 点サンプルして影レイを飛ばし, BSDF サンプリングと MIS (パワーヒューリスティック) で混ぜる
+class LightSamplingPathTracer : public PathTracer {
+public:
+	static float shadowRayEpsilon;
+
+	virtual Vector3 evalRadiance( std::shared_ptr<Scene> scene, const Ray &ray, Sampler &sampler );
+
+private:
+	// 乱数は呼ぶ側で先に取っておく. 光源サンプリングしない頂点でも同じ次元を使うように
+	Vector3 sampleDirectLight( const std::shared_ptr<Scene> &scene, const Intersection &intersection, const SampledRay &sample, float uLight, const Vector2 &uPoint );
+	static float powerHeuristic( float pdf, float otherPdf ) {
+		const float a = pdf * pdf;
+		const float b = otherPdf * otherPdf;
+		return a / ( a + b );
+	}
 };
@@ -0,0 +1,73 @@
+#include "Sampler.h"
+
+namespace {
+
+uint32_t reverseBits( uint32_t x ) {
+	x = ( x << 16 ) | ( x >> 16 );
+	x = ( ( x & 0x00ff00ff ) << 8 ) | ( ( x & 0xff00ff00 ) >> 8 );
+	x = ( ( x & 0x0f0f0f0f ) << 4 ) | ( ( x & 0xf0f0f0f0 ) >> 4 );
+	x = ( ( x & 0x33333333 ) << 2 ) | ( ( x & 0xcccccccc ) >> 2 );
+	x = ( ( x & 0x55555555 ) << 1 ) | ( ( x & 0xaaaaaaaa ) >> 1 );
+	return x;
+}
+
+// 下位ビットの値で上位ビットを並べ替えるハッシュ (Laine & Karras 2011 を Burley が改良したもの)
+uint32_t laineKarrasPermutation( uint32_t x, uint32_t seed ) {
+	x += seed;
+	x ^= x * 0x6c50b47cu;
+	x ^= x * 0xb82f1e52u;
+	x ^= x * 0xc7afe638u;
+	x ^= x * 0x8d22f6e6u;
+	return x;
+}
+
+// 上位ビットから順に木を辿って入れ替えるのと同じ (Owen スクランブル)
+uint32_t nestedUniformScramble( uint32_t x, uint32_t seed ) {
+	return reverseBits( laineKarrasPermutation( reverseBits( x ), seed ) );
+}
+
+uint32_t sobol0( uint32_t index ) {
+	return reverseBits( index );
+}
+
+// 原始多項式 x + 1. 方向数は v_k = v_{k-1} ^ ( v_{k-1} >> 1 )
+uint32_t sobol1( uint32_t index ) {
+	uint32_t result = 0;
+	for ( uint32_t v = 1u << 31; index != 0; index >>= 1, v ^= v >> 1 ) {
+		if ( index & 1 ) { result ^= v; }
+	}
+	return result;
+}
+
+float toFloat( uint32_t x ) {
+	return ( x >> 8 ) * ( 1.0f / 16777216.0f );
+}
+
+}
+
+void SobolSampler::startPixelSample( uint32_t pixel, uint32_t sampleIndex ) {
+	this->pixelSeed = (uint32_t)hash64( pixel );
+	this->sampleIndex = sampleIndex;
+	this->dimension = 0;
+}
+
+float SobolSampler::get1D() {
+	const uint32_t seed = getDimensionSeed();
+	const uint32_t index = nestedUniformScramble( sampleIndex, seed );
+	return toFloat( nestedUniformScramble( sobol0( index ), hashCombine( seed, 0 ) ) );
+}
+
+Vector2 SobolSampler::get2D() {
+	const uint32_t seed = getDimensionSeed();
+	const uint32_t index = nestedUniformScramble( sampleIndex, seed );
+	return Vector2(
+		toFloat( nestedUniformScramble( sobol0( index ), hashCombine( seed, 0 ) ) ),
+		toFloat( nestedUniformScramble( sobol1( index ), hashCombine( seed, 1 ) ) ) );
+}
+
+std::unique_ptr<Sampler> createSampler( SamplerType type ) {
+	if ( type == SamplerType::Sobol ) {
+		return std::make_unique<SobolSampler>();
+	}
+	return std::make_unique<IndependentSampler>();
+}
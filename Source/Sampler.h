@@ -0,0 +1,56 @@
+#pragma once
+
+#include "General.h"
+
+enum class SamplerType {
+	Independent, // randf() をそのまま使う
+	Sobol,       // Owen スクランブルした Sobol 列
+};
+
+// 1 本のパスで使う乱数を次元ごとに配る
+// 同じパスの中では呼ぶ順番で次元が決まるので, 分岐で呼ぶ回数を変えないようにする
+class Sampler {
+public:
+	virtual ~Sampler() {}
+
+	// 画素とサンプル番号を決めて次元を最初に戻す
+	virtual void startPixelSample( uint32_t pixel, uint32_t sampleIndex ) = 0;
+
+	// 次元を途中から配り直す. パスの頂点ごとに決まった次元から使えば, 分岐で使う数が違っても後ろがずれない
+	virtual void setDimension( uint32_t dimension ) = 0;
+
+	virtual float get1D() = 0;
+	virtual Vector2 get2D() = 0;
+};
+
+class IndependentSampler : public Sampler {
+public:
+	virtual void startPixelSample( uint32_t pixel, uint32_t sampleIndex ) { seedRandom( pixel, sampleIndex ); }
+	virtual void setDimension( uint32_t dimension ) {}
+	virtual float get1D() { return randf(); }
+	virtual Vector2 get2D() {
+		float x = randf();
+		float y = randf();
+		return Vector2( x, y );
+	}
+};
+
+// Burley 2020 "Practical Hash-based Owen Scrambling"
+// 次元ごとに添字をシャッフルして, 1 次元目と 2 次元目だけを Owen スクランブルして使う
+class SobolSampler : public Sampler {
+public:
+	virtual void startPixelSample( uint32_t pixel, uint32_t sampleIndex );
+	virtual void setDimension( uint32_t dimension ) { this->dimension = dimension; }
+	virtual float get1D();
+	virtual Vector2 get2D();
+
+private:
+	uint32_t getDimensionSeed() { return hashCombine( pixelSeed, dimension++ ); }
+	static uint32_t hashCombine( uint32_t seed, uint32_t v ) { return (uint32_t)hash64( ( (uint64_t)seed << 32 ) | v ); }
+
+	uint32_t pixelSeed;
+	uint32_t sampleIndex;
+	uint32_t dimension;
+};
+
+std::unique_ptr<Sampler> createSampler( SamplerType type );
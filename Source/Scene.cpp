@@ -2,35 +2,66 @@
 #include "General.h"
 #include "Scene.h"
 #include "Material.h"
+#include "Sampler.h"
+#include "Stats.h"
 
-std::optional<Intersection> Scene::getIntersection( const Ray &ray, const std::shared_ptr<ObjectStructureIteratorHistory> &history, std::shared_ptr<ObjectStructureIteratorHistory> *newHistory ) const {
-	auto objs = getObjectStructure();
+std::optional<Intersection> Scene::getIntersection( const Ray &ray, const std::shared_ptr<ObjectStructureIteratorHistory> &history, std::shared_ptr<ObjectStructureIteratorHistory> *newHistory, Sampler *sampler ) const {
+	const auto &objs = objectStructure;
+	Stats::add( StatCounter::Rays );
 
 	std::optional<Intersection> intersection;
 	if ( !ray.media.empty() && ray.media.top() != nullptr ) {
 		auto m = ray.media.top();
 		Intersection tmp;
-		tmp.t = m->sampleDistance();
+		assert( sampler != nullptr );
+		tmp.t = m->sampleDistance( sampler->get1D() );
 		tmp.i = -ray.d;
 		tmp.p = ray.o + tmp.t * ray.d;
 		tmp.n = Vector3( 0, 0, 0 );
 		tmp.object = nullptr;
-		tmp.material = m;
+		tmp.material = m->shared_from_this();
 		intersection = std::move( tmp );
 	}
 
-	auto it = objs->traverse( ray, history );
-	for ( ; !it->end(); it->next() ) {
-		auto tmp = ( *( *it ) )->getIntersection( ray );
-		if ( tmp
-			 && ( !intersection.has_value() || tmp->t < intersection->t ) ) {
-			intersection = std::move( tmp );
-			it->select( *intersection );
-		}
-	}
-	if ( newHistory != nullptr ) {
-		*newHistory = it->getHistory();
+	// 媒質中でサンプルした距離より奥は見なくていい
+	auto tmp = objs->getIntersection( ray, history, newHistory, intersection.has_value() ? intersection->t : std::numeric_limits<float>::infinity() );
+	if ( tmp ) {
+		intersection = std::move( tmp );
+	} else if ( intersection ) {
+		Stats::add( StatCounter::MediaEvents );
 	}
 
 	return intersection;
 }
+
+bool Scene::occluded( const Ray &ray, float tMax ) const {
+	Stats::add( StatCounter::ShadowRays );
+	return objectStructure->occluded( ray, tMax );
+}
+
+bool Scene::sampleLight( const Vector3 &p, const Vector3 &n, float uLight, const Vector2 &uPoint, LightSample *sample ) const {
+	// buildLightSampler を呼んでいなければ光源は無いのと同じ
+	if ( !lightSampler ) { return false; }
+	float pmf;
+	const int index = lightSampler->sample( p, n, uLight, &pmf );
+	if ( index < 0 ) { return false; }
+
+	const auto &light = explicitLights[index];
+	const float area = light->getArea();
+	if ( area <= 0.0f ) { return false; }
+
+	sample->point = light->samplePoint( uPoint );
+	sample->emission = light->material->getEmission();
+	sample->pdf = pmf / area;
+	return true;
+}
+
+float Scene::getLightPdf( const Vector3 &p, const Vector3 &n, const PrimitiveObject *object ) const {
+	if ( !lightSampler ) { return 0.0f; }
+	auto it = lightIndices.find( object );
+	if ( it == lightIndices.end() ) { return 0.0f; }
+
+	const float area = object->getArea();
+	if ( area <= 0.0f ) { return 0.0f; }
+	return lightSampler->getPmf( p, n, it->second ) / area;
+}
@@ -3,6 +3,19 @@
 #include "General.h"
 #include "Geometry.h"
 #include "ObjectStructure.h"
+#include "Mesh.h"
+#include "LightSampler.h"
+
+#include <unordered_map>
+
+class Sampler;
+
+// 光源上で選んだ点. pdf は面積あたりで, 光源を選ぶ確率も含む
+struct LightSample {
+	PointOnSurface point;
+	Vector3 emission;
+	float pdf;
+};
 
 class Scene {
 public:
@@ -10,8 +23,14 @@ public:
 		objects.push_back(obj);
 	}
 
-	std::shared_ptr<ObjectStructure> buildObjectStructure() {
-		return objectStructure = std::make_shared<BVH>(objects);
+	std::shared_ptr<ObjectStructure> buildObjectStructure(ObjectStructureType type = ObjectStructureType::BVH, BVHBuildMethod method = BVHBuildMethod::BinnedSAH) {
+		// 先にメッシュごとの BVH を作っておいて, シーンの BVH はインスタンスを葉として持つ
+		for (auto &obj : objects) {
+			if (auto instance = std::dynamic_pointer_cast<MeshInstance>(obj)) {
+				instance->getMesh()->buildObjectStructure(type, method);
+			}
+		}
+		return objectStructure = ::buildObjectStructure(objects, type, method);
 	}
 
 	std::shared_ptr<ObjectStructure> getObjectStructure() const {
@@ -19,6 +38,7 @@ public:
 	}
 
 	void addExplicitLight(std::shared_ptr<PrimitiveObject> light) {
+		lightIndices[light.get()] = (int)explicitLights.size();
 		explicitLights.push_back(light);
 	}
 
@@ -26,9 +46,24 @@ public:
 		return explicitLights;
 	}
 
-	std::optional<Intersection> getIntersection( const Ray &ray, const std::shared_ptr<ObjectStructureIteratorHistory> &history, std::shared_ptr<ObjectStructureIteratorHistory> *newHistory ) const;
+	// 光源を全部追加してから呼ぶ
+	void buildLightSampler( LightSamplerType type = LightSamplerType::BVH ) {
+		lightSampler = createLightSampler( type, explicitLights );
+	}
+
+	// 媒質の中にいるときは sampler で散乱する距離を決める
+	std::optional<Intersection> getIntersection( const Ray &ray, const std::shared_ptr<ObjectStructureIteratorHistory> &history, std::shared_ptr<ObjectStructureIteratorHistory> *newHistory, Sampler *sampler = nullptr ) const;
+	// ray.o から tMax までの間に何かあれば true. 媒質は見ない
+	bool occluded( const Ray &ray, float tMax ) const;
+
+	// シェーディング点 p, n から見て明示的な光源を lightSampler で選んで, その上の点を面積一様に選ぶ
+	bool sampleLight( const Vector3 &p, const Vector3 &n, float uLight, const Vector2 &uPoint, LightSample *sample ) const;
+	// sampleLight で object 上の点が選ばれる確率密度 (面積あたり). 明示的な光源でなければ 0
+	float getLightPdf( const Vector3 &p, const Vector3 &n, const PrimitiveObject *object ) const;
 private:
 	spvector<Object> objects;
 	std::shared_ptr<ObjectStructure> objectStructure;
 	spvector<PrimitiveObject> explicitLights;
+	std::unordered_map<const PrimitiveObject*, int> lightIndices;
+	std::shared_ptr<LightSampler> lightSampler;
 };
@@ -0,0 +1,424 @@
+#include "SceneLoader.h"
+
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <unordered_map>
+#include <set>
+
+#include "Scene.h"
+#include "Material.h"
+#include "Mesh.h"
+#include "Texture.h"
+#include "Quaternion.h"
+
+namespace {
+
+// 行の中で見つけたおかしなところ. loadSceneFile で行番号を付けて出す
+struct SceneFileError : public std::runtime_error {
+	using std::runtime_error::runtime_error;
+};
+
+bool parseFloat( const std::string &s, float *value ) {
+	if ( s.empty() ) { return false; }
+	char *end;
+	*value = strtof( s.c_str(), &end );
+	return *end == '\0';
+}
+
+bool parseInt( const std::string &s, int *value ) {
+	if ( s.empty() ) { return false; }
+	char *end;
+	const long v = strtol( s.c_str(), &end, 10 );
+	*value = (int)v;
+	return *end == '\0';
+}
+
+std::vector<std::string> split( const std::string &s, char delimiter ) {
+	std::vector<std::string> result;
+	std::string item;
+	std::istringstream stream( s );
+	while ( std::getline( stream, item, delimiter ) ) {
+		result.push_back( item );
+	}
+	return result;
+}
+
+struct Line {
+	std::string command;
+	std::vector<std::string> words; // = の付いていない語. 先頭が名前で, 残りはフラグ
+	std::unordered_map<std::string, std::string> params;
+	mutable std::set<std::string> used;
+
+	bool has( const std::string &key ) const { return params.count( key ) != 0; }
+
+	const std::string& getString( const std::string &key ) const {
+		auto it = params.find( key );
+		if ( it == params.end() ) { throw SceneFileError( command + ": missing " + key + "=" ); }
+		used.insert( key );
+		return it->second;
+	}
+
+	std::vector<float> getFloats( const std::string &key ) const {
+		std::vector<float> values;
+		for ( const auto &item : split( getString( key ), ',' ) ) {
+			float value;
+			if ( !parseFloat( item, &value ) ) { throw SceneFileError( key + "=" + params.at( key ) + " is not a number" ); }
+			values.push_back( value );
+		}
+		return values;
+	}
+
+	float getFloat( const std::string &key ) const {
+		const auto values = getFloats( key );
+		if ( values.size() != 1 ) { throw SceneFileError( key + "= needs 1 number" ); }
+		return values[0];
+	}
+	float getFloat( const std::string &key, float defaultValue ) const {
+		return has( key ) ? getFloat( key ) : defaultValue;
+	}
+
+	Vector3 getVector3( const std::string &key ) const {
+		const auto values = getFloats( key );
+		if ( values.size() == 1 ) { return Vector3( values[0] ); }
+		if ( values.size() != 3 ) { throw SceneFileError( key + "= needs 1 or 3 numbers" ); }
+		return Vector3( values[0], values[1], values[2] );
+	}
+	Vector3 getVector3( const std::string &key, const Vector3 &defaultValue ) const {
+		return has( key ) ? getVector3( key ) : defaultValue;
+	}
+
+	const std::string& getName() const {
+		if ( words.empty() ) { throw SceneFileError( command + ": missing name" ); }
+		return words[0];
+	}
+
+	bool hasFlag( const std::string &flag ) const {
+		return std::find( words.begin(), words.end(), flag ) != words.end();
+	}
+
+	// 綴りを間違えた key を黙って無視しないように, 読まなかったものがあれば止める
+	void checkUnused() const {
+		for ( const auto &param : params ) {
+			if ( used.count( param.first ) == 0 ) { throw SceneFileError( command + ": unknown parameter " + param.first + "=" ); }
+		}
+	}
+};
+
+// "" の中の空白は区切りにしない
+std::vector<std::string> tokenize( const std::string &text ) {
+	std::vector<std::string> tokens;
+	std::string token;
+	bool quoted = false;
+	bool hasToken = false;
+	for ( char c : text ) {
+		if ( c == '"' ) {
+			quoted = !quoted;
+			hasToken = true;
+		} else if ( !quoted && ( c == ' ' || c == '\t' || c == '\r' ) ) {
+			if ( hasToken ) { tokens.push_back( token ); }
+			token.clear();
+			hasToken = false;
+		} else {
+			token += c;
+			hasToken = true;
+		}
+	}
+	if ( quoted ) { throw SceneFileError( "unterminated \"" ); }
+	if ( hasToken ) { tokens.push_back( token ); }
+	return tokens;
+}
+
+Line parseLine( const std::vector<std::string> &tokens ) {
+	Line line;
+	line.command = tokens[0];
+	for ( size_t i = 1; i < tokens.size(); i++ ) {
+		const size_t eq = tokens[i].find( '=' );
+		if ( eq == std::string::npos ) {
+			line.words.push_back( tokens[i] );
+		} else {
+			line.params[tokens[i].substr( 0, eq )] = tokens[i].substr( eq + 1 );
+		}
+	}
+	return line;
+}
+
+bool isAbsolutePath( const std::string &path ) {
+	return !path.empty() && ( path[0] == '/' || path[0] == '\\' || ( path.size() > 1 && path[1] == ':' ) );
+}
+
+class SceneFileLoader {
+public:
+	SceneFileLoader( const std::string &filename, SceneDescription *description ) : description( description ) {
+		const size_t slash = filename.find_last_of( "/\\" );
+		directory = slash == std::string::npos ? "" : filename.substr( 0, slash + 1 );
+	}
+
+	void execute( const Line &line ) {
+		if ( line.command == "set" ) {
+			for ( const auto &param : line.params ) {
+				if ( !description->settings.set( param.first, param.second ) ) {
+					throw SceneFileError( "set: invalid setting " + param.first + "=" + param.second );
+				}
+				line.used.insert( param.first );
+			}
+		} else if ( line.command == "camera" ) {
+			loadCamera( line );
+		} else if ( line.command == "texture" ) {
+			define( &textures, line.getName(), std::make_shared<Texture>( getPath( line, "file" ) ) );
+		} else if ( line.command == "media" ) {
+			define( &media, line.getName(), loadMedia( line ) );
+		} else if ( line.command == "material" ) {
+			define( &materials, line.getName(), loadMaterial( line ) );
+		} else if ( line.command == "mesh" ) {
+			define( &meshes, line.getName(), loadMesh( line ) );
+		} else if ( line.command == "instance" ) {
+			loadInstance( line );
+		} else if ( line.command == "quad" ) {
+			loadQuad( line );
+		} else if ( line.command == "sphere" ) {
+			auto sphere = std::make_shared<Sphere>( line.getVector3( "center" ), line.getFloat( "radius" ), find( materials, line.getString( "material" ) ) );
+			addObject( line, sphere );
+		} else {
+			throw SceneFileError( "unknown command " + line.command );
+		}
+		line.checkUnused();
+	}
+
+private:
+	template <class T>
+	static void define( std::unordered_map<std::string, std::shared_ptr<T>> *map, const std::string &name, const std::shared_ptr<T> &value ) {
+		if ( map->count( name ) != 0 ) { throw SceneFileError( name + " is already defined" ); }
+		( *map )[name] = value;
+	}
+
+	template <class T>
+	static std::shared_ptr<T> find( const std::unordered_map<std::string, std::shared_ptr<T>> &map, const std::string &name ) {
+		auto it = map.find( name );
+		if ( it == map.end() ) { throw SceneFileError( name + " is not defined" ); }
+		return it->second;
+	}
+
+	// 開けないファイルを渡すと Texture などは落ちるので, ここで先に確かめる
+	std::string getPath( const Line &line, const std::string &key ) const {
+		const std::string &path = line.getString( key );
+		const std::string resolved = isAbsolutePath( path ) ? path : directory + path;
+		if ( !std::ifstream( resolved ) ) { throw SceneFileError( "cannot open " + resolved ); }
+		return resolved;
+	}
+
+	void loadCamera( const Line &line ) {
+		Camera &camera = description->camera;
+		camera.position = line.getVector3( "position", camera.position );
+		if ( line.has( "lookAt" ) ) {
+			camera.eye = line.getVector3( "lookAt" ) - camera.position;
+		} else {
+			camera.eye = line.getVector3( "eye", camera.eye );
+		}
+		camera.eye.normalize();
+		camera.up = line.getVector3( "up", camera.up );
+		camera.horizontalFOV = line.getFloat( "fov", camera.horizontalFOV );
+	}
+
+	std::shared_ptr<ParticipatingMedia> loadMedia( const Line &line ) {
+		const std::string type = line.has( "type" ) ? line.getString( "type" ) : "isotropic";
+		if ( type != "isotropic" ) { throw SceneFileError( "media: unknown type=" + type ); }
+
+		// 消散係数と, そのうち散乱の割合で書く
+		auto isotropic = std::make_shared<IsotopicMedia>();
+		isotropic->albedo = line.getVector3( "albedo", Vector3( 1.0f ) );
+		const float extinction = line.getFloat( "extinction" );
+		const float a = line.getFloat( "scatteringAlbedo" );
+		isotropic->absorptionCoefficient = extinction * ( 1 - a );
+		isotropic->scatteringCoefficient = extinction * a;
+		return isotropic;
+	}
+
+	std::shared_ptr<Material> loadMaterial( const Line &line ) {
+		const std::string &type = line.getString( "type" );
+		std::shared_ptr<Material> material;
+		if ( type == "diffuse" ) {
+			material = std::make_shared<Diffuse>( line.getVector3( "albedo" ), line.getVector3( "emission", Vector3( 0.0f ) ) );
+		} else if ( type == "diffuseTextured" ) {
+			material = std::make_shared<DiffuseTextured>( find( textures, line.getString( "texture" ) ) );
+		} else if ( type == "dipole" ) {
+			material = std::make_shared<DipoleSSS>( line.getVector3( "albedo" ), line.getFloat( "extinction" ), line.getFloat( "ior" ), line.getFloat( "rmax" ) );
+		} else if ( type == "ggxReflection" ) {
+			material = std::make_shared<GGXReflection>( line.getVector3( "albedo" ), line.getFloat( "roughness" ) );
+		} else if ( type == "ggxRefraction" ) {
+			material = std::make_shared<GGXRefraction>( line.getFloat( "ior" ), line.getFloat( "roughness" ) );
+		} else if ( type == "ggxTextured" ) {
+			material = std::make_shared<GGXTextured>( find( textures, line.getString( "texture" ) ), line.getFloat( "roughness" ) );
+		} else {
+			throw SceneFileError( "material: unknown type=" + type );
+		}
+
+		if ( line.has( "media" ) ) {
+			material->participatingMedia = find( media, line.getString( "media" ) );
+		}
+		return material;
+	}
+
+	std::shared_ptr<Mesh> loadMesh( const Line &line ) {
+		MeshMaterialMap map;
+		if ( line.has( "material" ) ) {
+			map.defaultMaterial = find( materials, line.getString( "material" ) );
+		}
+		// material.kanten=kanten のように, OBJ のオブジェクト名の頭でマテリアルを決める
+		const std::string prefixKey = "material.";
+		for ( const auto &param : line.params ) {
+			if ( param.first.compare( 0, prefixKey.size(), prefixKey ) == 0 ) {
+				map.prefixes.emplace_back( param.first.substr( prefixKey.size() ), find( materials, line.getString( param.first ) ) );
+			}
+		}
+
+		auto mesh = std::make_shared<Mesh>();
+		const std::string path = getPath( line, "file" );
+		if ( !mesh->loadFile( path, map ) ) { throw SceneFileError( "cannot read mesh " + path ); }
+		return mesh;
+	}
+
+	void loadInstance( const Line &line ) {
+		const auto mesh = find( meshes, line.getString( "mesh" ) );
+		const Vector3 axis = line.getVector3( "axis", Vector3( 0, 1, 0 ) );
+		const Transform transform(
+			line.getVector3( "position", Vector3( 0.0f ) ),
+			line.getVector3( "scale", Vector3( 1.0f ) ),
+			Quaternion::quaternionRotationAxis( axis.normalized(), line.getFloat( "angle", 0.0f ) * ToRad ) );
+		description->scene->addObject( mesh->createInstance( transform ) );
+	}
+
+	void loadQuad( const Line &line ) {
+		const auto material = find( materials, line.getString( "material" ) );
+		Vector3 p[4];
+		for ( int i = 0; i < 4; i++ ) {
+			p[i] = line.getVector3( "p" + std::to_string( i ) );
+		}
+		std::vector<float> uv = { 0, 0, 1, 0, 1, 1, 0, 1 };
+		if ( line.has( "uv" ) ) {
+			uv = line.getFloats( "uv" );
+			if ( uv.size() != 8 ) { throw SceneFileError( "quad: uv= needs 8 numbers" ); }
+		}
+
+		const int corners[2][3] = { { 0, 1, 2 }, { 0, 2, 3 } };
+		for ( const auto &corner : corners ) {
+			auto triangle = std::make_shared<Triangle>();
+			for ( int k = 0; k < 3; k++ ) {
+				triangle->v[k].p = p[corner[k]];
+				triangle->v[k].texCoord = Vector2( uv[corner[k] * 2 + 0], uv[corner[k] * 2 + 1] );
+			}
+			triangle->material = material;
+			triangle->calcNormal();
+			addObject( line, triangle );
+		}
+	}
+
+	void addObject( const Line &line, const std::shared_ptr<PrimitiveObject> &object ) {
+		description->scene->addObject( object );
+		if ( line.hasFlag( "light" ) ) {
+			description->scene->addExplicitLight( object );
+		}
+	}
+
+	SceneDescription *description;
+	std::string directory;
+	std::unordered_map<std::string, std::shared_ptr<Texture>> textures;
+	std::unordered_map<std::string, std::shared_ptr<ParticipatingMedia>> media;
+	std::unordered_map<std::string, std::shared_ptr<Material>> materials;
+	std::unordered_map<std::string, std::shared_ptr<Mesh>> meshes;
+};
+
+};
+
+bool RenderSettings::set( const std::string &key, const std::string &value ) {
+	auto setInt = [&]( int *target, int minValue ) {
+		int v;
+		if ( !parseInt( value, &v ) || v < minValue ) { return false; }
+		*target = v;
+		return true;
+	};
+	auto setFloat = [&]( float *target ) {
+		float v;
+		if ( !parseFloat( value, &v ) ) { return false; }
+		*target = v;
+		return true;
+	};
+
+	if ( key == "width" ) { return setInt( &width, 1 ); }
+	if ( key == "height" ) { return setInt( &height, 1 ); }
+	if ( key == "samples" ) { return setInt( &sampling, 1 ); }
+	if ( key == "timeLimit" ) { return setInt( &timeLimit, 1 ); }
+	if ( key == "outputInterval" ) { return setInt( &outputInterval, 1 ); }
+	if ( key == "samplesPerPass" ) { return setInt( &samplesPerPass, 1 ); }
+	if ( key == "minAdaptiveSamples" ) { return setInt( &minAdaptiveSamples, 0 ); }
+	if ( key == "adaptiveThreshold" ) { return setFloat( &adaptiveThreshold ); }
+	if ( key == "russianRoulette" ) { return setFloat( &russianRouletteProbability ); }
+	if ( key == "originOffset" ) { return setFloat( &originOffset ); }
+	if ( key == "output" ) { outputPrefix = value; return true; }
+	if ( key == "stats" ) { statsFile = value; return true; }
+
+	if ( key == "objectStructure" ) {
+		if ( value == "BVH" ) { objectStructureType = ObjectStructureType::BVH; return true; }
+		if ( value == "BVH4" ) { objectStructureType = ObjectStructureType::BVH4; return true; }
+		return false;
+	}
+	if ( key == "lightSampler" ) {
+		if ( value == "Uniform" ) { lightSamplerType = LightSamplerType::Uniform; return true; }
+		if ( value == "Power" ) { lightSamplerType = LightSamplerType::Power; return true; }
+		if ( value == "BVH" ) { lightSamplerType = LightSamplerType::BVH; return true; }
+		return false;
+	}
+	if ( key == "sampler" ) {
+		if ( value == "Independent" ) { samplerType = SamplerType::Independent; return true; }
+		if ( value == "Sobol" ) { samplerType = SamplerType::Sobol; return true; }
+		return false;
+	}
+	return false;
+}
+
+bool loadSceneFile( const std::string &filename, SceneDescription *description ) {
+	std::ifstream ifs( filename );
+	if ( !ifs ) {
+		fprintf( stderr, "Cannot open scene file %s\n", filename.c_str() );
+		return false;
+	}
+
+	description->scene = std::make_shared<Scene>();
+	description->camera.position = Vector3( 0.0f );
+	description->camera.eye = Vector3( 0, 0, 1 );
+	description->camera.up = Vector3( 0, 1, 0 );
+	description->camera.horizontalFOV = 35.0f;
+
+	SceneFileLoader loader( filename, description );
+	std::string text;
+	std::string line;
+	int lineNumber = 0;
+	int firstLineNumber = 0;
+	while ( std::getline( ifs, line ) ) {
+		lineNumber++;
+		if ( text.empty() ) { firstLineNumber = lineNumber; }
+
+		const size_t comment = line.find( '#' );
+		if ( comment != std::string::npos ) { line.erase( comment ); }
+		while ( !line.empty() && isspace( (unsigned char)line.back() ) ) { line.pop_back(); }
+		if ( !line.empty() && line.back() == '\\' ) {
+			line.pop_back();
+			text += line + " ";
+			continue;
+		}
+		text += line;
+
+		try {
+			const auto tokens = tokenize( text );
+			if ( !tokens.empty() ) {
+				loader.execute( parseLine( tokens ) );
+			}
+		}
+		catch ( SceneFileError &e ) {
+			fprintf( stderr, "%s:%d: %s\n", filename.c_str(), firstLineNumber, e.what() );
+			return false;
+		}
+		text.clear();
+	}
+	return true;
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include "General.h"
+#include "Camera.h"
+#include "ObjectStructure.h"
+#include "LightSampler.h"
+#include "Sampler.h"
+
+#include <string>
+
+class Scene;
+
+// シーンファイル
+//
+// 1 行に 1 つ. "コマンド 名前 key=value key=x,y,z フラグ" の形で, # から後はコメント
+// 行末の \ で次の行に続く. 空白を含む値は "" で囲む
+// 名前で参照するもの (テクスチャ, 媒質, マテリアル, メッシュ) は使う前の行で定義しておく
+// ファイルのパスはシーンファイルのあるフォルダから数える
+//
+//   set      width=800 height=600 samples=4096 ...       RenderSettings::set と同じ key
+//   camera   position=x,y,z eye=x,y,z (か lookAt=x,y,z) up=x,y,z fov=水平画角 (度)
+//   texture  名前 file=
+//   media    名前 type=isotropic albedo= extinction= scatteringAlbedo=
+//   material 名前 type=diffuse albedo= emission=
+//                 type=diffuseTextured texture=
+//                 type=dipole albedo= extinction= ior= rmax=
+//                 type=ggxReflection albedo= roughness=
+//                 type=ggxRefraction ior= roughness=
+//                 type=ggxTextured texture= roughness=
+//                 どれでも media= で中の媒質を指定できる
+//   mesh     名前 file=*.obj material=既定 material.接頭辞=マテリアル ...   (MeshMaterialMap)
+//   instance mesh= position= scale= axis= angle=度
+//   quad     material= p0= p1= p2= p3= uv=u0,v0,...,u3,v3 [light]   (p0 p1 p2) と (p0 p2 p3) の三角形 2 枚
+//   sphere   material= center= radius= [light]
+//
+// light を付けたものは明示的な光源にもする
+// Vector3 の値は 1 つだけ書くと 3 成分とも同じ値になる
+
+// レンダリングの設定. 既定値はみつ豆を 800x600 で 2 分
+struct RenderSettings {
+	int width = 800;
+	int height = 600;
+	int sampling = 4096;             // 画素あたりの上限
+	int timeLimit = 120;             // 秒. 起動したときから数える
+	int outputInterval = 15;         // 秒. 途中経過を書き出す間隔
+	int samplesPerPass = 4;
+	int minAdaptiveSamples = 32;
+	float adaptiveThreshold = 0.01f; // 0 で適応サンプリングしない
+	ObjectStructureType objectStructureType = ObjectStructureType::BVH4;
+	LightSamplerType lightSamplerType = LightSamplerType::BVH;
+	SamplerType samplerType = SamplerType::Sobol;
+	float russianRouletteProbability = 0.95f;
+	float originOffset = 0.00001f;
+	std::string outputPrefix;        // PNG の名前の頭. "out/" ならフォルダの下に 000.png, 001.png, ...
+	std::string statsFile = "stats.json"; // 空なら書かない
+
+	// key (width, height, samples, timeLimit, outputInterval, samplesPerPass, minAdaptiveSamples,
+	// adaptiveThreshold, objectStructure, lightSampler, sampler, russianRoulette, originOffset, output, stats) を 1 つ書き換える
+	// 知らない key や読めない値なら何もしないで false
+	bool set( const std::string &key, const std::string &value );
+};
+
+struct SceneDescription {
+	std::shared_ptr<Scene> scene;
+	Camera camera;
+	RenderSettings settings;
+};
+
+// 読めなかったら "ファイル名:行: 理由" を stderr に出して false
+bool loadSceneFile( const std::string &filename, SceneDescription *description );
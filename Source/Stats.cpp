@@ -0,0 +1,88 @@
+#include "Stats.h"
+
+#include <mutex>
+#include <fstream>
+
+namespace {
+
+const char *counterNames[(int)StatCounter::Count] = {
+	"rays",
+	"shadowRays",
+	"nodesVisited",
+	"boxTests",
+	"primitiveTests",
+	"sssProbeRays",
+	"mediaEvents",
+};
+
+// スレッドが終わってもカウンタは残しておきたいので, 本体はここで持つ
+std::mutex registryMutex;
+std::vector<std::unique_ptr<Stats::ThreadStats>> registry;
+
+std::vector<std::pair<std::string, double>> phases;
+
+};
+
+Stats::ThreadStats* Stats::registerThread() {
+	std::lock_guard<std::mutex> lock( registryMutex );
+	registry.push_back( std::make_unique<ThreadStats>() );
+	return registry.back().get();
+}
+
+void Stats::addPhaseTime( const std::string &name, double seconds ) {
+	for ( auto &phase : phases ) {
+		if ( phase.first == name ) {
+			phase.second += seconds;
+			return;
+		}
+	}
+	phases.emplace_back( name, seconds );
+}
+
+bool Stats::writeJSON( const std::string &filename ) {
+	ThreadStats total;
+	int threadCount;
+	{
+		std::lock_guard<std::mutex> lock( registryMutex );
+		threadCount = (int)registry.size();
+		for ( const auto &stats : registry ) {
+			for ( int i = 0; i < (int)StatCounter::Count; i++ ) {
+				total.counters[i] += stats->counters[i];
+			}
+			for ( int i = 0; i <= maxPathLength; i++ ) {
+				total.pathLengths[i] += stats->pathLengths[i];
+			}
+		}
+	}
+
+	std::ofstream ofs( filename );
+	if ( !ofs ) { return false; }
+
+	ofs << "{\n";
+	ofs << "\t\"enabled\": " << ( XALIA_STATS ? "true" : "false" ) << ",\n";
+	ofs << "\t\"threads\": " << threadCount << ",\n";
+
+	ofs << "\t\"phases\": {";
+	for ( int i = 0; i < (int)phases.size(); i++ ) {
+		ofs << ( i == 0 ? "\n" : ",\n" ) << "\t\t\"" << phases[i].first << "\": " << phases[i].second;
+	}
+	ofs << "\n\t},\n";
+
+	ofs << "\t\"counters\": {";
+	for ( int i = 0; i < (int)StatCounter::Count; i++ ) {
+		ofs << ( i == 0 ? "\n" : ",\n" ) << "\t\t\"" << counterNames[i] << "\": " << total.counters[i];
+	}
+	ofs << "\n\t},\n";
+
+	// 添字がパスの長さ (カメラからの反射回数 + 1). 最後の箱はそれ以上をまとめたもの
+	int last = maxPathLength;
+	while ( last > 0 && total.pathLengths[last] == 0 ) { last--; }
+	ofs << "\t\"pathLengths\": [";
+	for ( int i = 0; i <= last; i++ ) {
+		ofs << ( i == 0 ? "" : ", " ) << total.pathLengths[i];
+	}
+	ofs << "]\n";
+	ofs << "}\n";
+
+	return (bool)ofs;
+}
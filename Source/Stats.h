@@ -0,0 +1,61 @@
+#pragma once
+
+#include "General.h"
+
+#include <string>
+
+// 0 にするとカウンタは何もしなくなる. 区間の時間は 0 でも測る
+#ifndef XALIA_STATS
+#define XALIA_STATS 1
+#endif
+
+enum class StatCounter {
+	Rays,           // 一番近い交差を探したレイ. SSS のプローブも含む
+	ShadowRays,     // occluded で調べたレイ
+	NodesVisited,   // スタックから取り出して調べた BVH, BVH4 のノード
+	BoxTests,       // AABB との交差判定. BVH4 は 1 ノードで 4 回と数える
+	PrimitiveTests, // 葉でのプリミティブとの交差判定. メッシュのインスタンスも 1 回
+	SSSProbeRays,   // 表面下散乱で出口を探すレイ
+	MediaEvents,    // 媒質の中で散乱した回数
+	Count,
+};
+
+// ホットパスのカウンタ. スレッドごとに thread_local で持つので排他はいらない
+// 走査の中では手元の変数で数えておいて, 最後にまとめて足す
+class Stats {
+public:
+	static const int maxPathLength = 64; // これより長いパスは最後の箱に入れる
+
+	// 隣のスレッドのぶんと同じキャッシュラインに載らないように
+	struct alignas( 64 ) ThreadStats {
+		uint64_t counters[(int)StatCounter::Count] = {};
+		uint64_t pathLengths[maxPathLength + 1] = {};
+	};
+
+	static void add( StatCounter counter, uint64_t n = 1 ) {
+#if XALIA_STATS
+		getThreadStats().counters[(int)counter] += n;
+#endif
+	}
+	static void addPathLength( int length ) {
+#if XALIA_STATS
+		getThreadStats().pathLengths[clamp( length, 0, maxPathLength )]++;
+#endif
+	}
+
+	// 区間ごとの経過時間. 同じ名前なら足していく. メインスレッドから呼ぶ
+	static void addPhaseTime( const std::string &name, double seconds );
+
+	// 全スレッドのぶんを足して JSON で書き出す. レンダリングのスレッドが止まってから呼ぶ
+	static bool writeJSON( const std::string &filename );
+
+private:
+	// 関数の中の thread_local だと毎回初期化済みかを確かめるので, 0 初期化のポインタにしてインラインで引く
+	static inline thread_local ThreadStats *threadStats = nullptr;
+
+	static ThreadStats& getThreadStats() {
+		if ( !threadStats ) { threadStats = registerThread(); }
+		return *threadStats;
+	}
+	static ThreadStats* registerThread();
+};
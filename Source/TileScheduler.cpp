@@ -0,0 +1,126 @@
+#include "TileScheduler.h"
+
+namespace {
+
+// 下位 16 ビットを 1 ビットおきに広げる
+uint32_t part1By1( uint32_t x ) {
+	x &= 0x0000ffff;
+	x = ( x | ( x << 8 ) ) & 0x00ff00ff;
+	x = ( x | ( x << 4 ) ) & 0x0f0f0f0f;
+	x = ( x | ( x << 2 ) ) & 0x33333333;
+	x = ( x | ( x << 1 ) ) & 0x55555555;
+	return x;
+}
+
+uint32_t encodeMorton2( uint32_t x, uint32_t y ) {
+	return ( part1By1( y ) << 1 ) | part1By1( x );
+}
+
+};
+
+TileScheduler::TileScheduler( int width, int height, int tileSize ) {
+	const int tilesX = ( width + tileSize - 1 ) / tileSize;
+	const int tilesY = ( height + tileSize - 1 ) / tileSize;
+
+	std::vector<std::pair<uint32_t, Tile>> ordered;
+	ordered.reserve( tilesX * tilesY );
+	for ( int ty = 0; ty < tilesY; ty++ ) {
+		for ( int tx = 0; tx < tilesX; tx++ ) {
+			Tile tile;
+			tile.x0 = tx * tileSize;
+			tile.y0 = ty * tileSize;
+			tile.x1 = min( tile.x0 + tileSize, width );
+			tile.y1 = min( tile.y0 + tileSize, height );
+			ordered.emplace_back( encodeMorton2( tx, ty ), tile );
+		}
+	}
+	std::sort( ordered.begin(), ordered.end(), []( const std::pair<uint32_t, Tile> &a, const std::pair<uint32_t, Tile> &b ) { return a.first < b.first; } );
+
+	tiles.reserve( ordered.size() );
+	for ( const auto &t : ordered ) {
+		tiles.push_back( t.second );
+	}
+	converged.assign( tiles.size(), 0 );
+	secondsPerSample.assign( tiles.size(), -1.0 );
+}
+
+int TileScheduler::getActiveTileCount() const {
+	return (int)std::count( converged.begin(), converged.end(), 0 );
+}
+
+void TileScheduler::reset( int threadCount ) {
+	while ( (int)queues.size() < threadCount ) {
+		queues.push_back( std::make_unique<Queue>() );
+	}
+	queues.resize( threadCount );
+	outOfTime = false;
+
+	// Morton 順で連続した範囲を配るので, スレッドごとに画面の近い場所をまとめて描く
+	std::vector<int> activeTiles;
+	for ( int i = 0; i < (int)tiles.size(); i++ ) {
+		if ( !converged[i] ) { activeTiles.push_back( i ); }
+	}
+	const int tileCount = (int)activeTiles.size();
+	for ( int t = 0; t < threadCount; t++ ) {
+		auto &queue = *queues[t];
+		queue.tiles.clear();
+		const int begin = (int)( (int64_t)tileCount * t / threadCount );
+		const int end = (int)( (int64_t)tileCount * ( t + 1 ) / threadCount );
+		for ( int i = begin; i < end; i++ ) {
+			queue.tiles.push_back( activeTiles[i] );
+		}
+	}
+}
+
+bool TileScheduler::next( int threadIndex, int passSamples, int *tileIndex ) {
+	while ( pop( threadIndex, tileIndex ) ) {
+		// 重いタイルが間に合わなくても, 軽いタイルなら入るかもしれないので続けて見る
+		const auto end = Clock::now() + std::chrono::duration_cast<Clock::duration>( std::chrono::duration<double>( predictSeconds( *tileIndex, passSamples ) ) );
+		if ( end <= deadline ) { return true; }
+		outOfTime = true;
+	}
+	return false;
+}
+
+void TileScheduler::reportTileTime( int tileIndex, int samples, double seconds ) {
+	if ( samples <= 0 ) { return; }
+	secondsPerSample[tileIndex] = seconds / samples;
+	measuredNanoseconds += (int64_t)( seconds * 1e9 );
+	measuredSamples += samples;
+}
+
+double TileScheduler::predictSeconds( int tileIndex, int samples ) const {
+	if ( secondsPerSample[tileIndex] >= 0.0 ) {
+		return secondsPerSample[tileIndex] * samples;
+	}
+	const int64_t count = measuredSamples;
+	return count > 0 ? (double)measuredNanoseconds / count * 1e-9 * samples : 0.0;
+}
+
+bool TileScheduler::pop( int threadIndex, int *tileIndex ) {
+	if ( threadIndex < (int)queues.size() ) {
+		auto &queue = *queues[threadIndex];
+		std::lock_guard<std::mutex> lock( queue.mutex );
+		if ( !queue.tiles.empty() ) {
+			*tileIndex = queue.tiles.front();
+			queue.tiles.pop_front();
+			return true;
+		}
+	}
+	return steal( threadIndex, tileIndex );
+}
+
+bool TileScheduler::steal( int threadIndex, int *tileIndex ) {
+	// 持ち主が前から取っていくので, 後ろから取れば取り合いになりにくい
+	const int queueCount = (int)queues.size();
+	for ( int i = 1; i <= queueCount; i++ ) {
+		auto &victim = *queues[( threadIndex + i ) % queueCount];
+		std::lock_guard<std::mutex> lock( victim.mutex );
+		if ( !victim.tiles.empty() ) {
+			*tileIndex = victim.tiles.back();
+			victim.tiles.pop_back();
+			return true;
+		}
+	}
+	return false;
+}
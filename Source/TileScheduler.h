@@ -0,0 +1,64 @@
+#pragma once
+
+#include "General.h"
+
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+
+struct Tile {
+	int x0, y0; // 左上
+	int x1, y1; // 右下 (含まない)
+};
+
+// 画面をタイルに分けて Morton 順に並べ, スレッドごとのキューに連続した範囲で配る
+// 自分のキューが空になったら他のスレッドのキューの後ろから盗む
+// 収束したタイルは次のパスから配らない
+// 締め切りを決めておくと, 前のパスで測った時間から見て間に合わないタイルも配らない
+class TileScheduler {
+public:
+	using Clock = std::chrono::steady_clock;
+
+	TileScheduler( int width, int height, int tileSize = 32 );
+
+	// パスの最初に 1 スレッドだけで呼ぶ
+	void reset( int threadCount );
+	// threadIndex のスレッドが次に passSamples サンプル描くタイルの番号. 全部なくなったら false
+	bool next( int threadIndex, int passSamples, int *tileIndex );
+	// 描くのにかかった時間. 次からの見積もりに使う
+	void reportTileTime( int tileIndex, int samples, double seconds );
+
+	void setDeadline( Clock::time_point deadline ) { this->deadline = deadline; }
+	// このパスで締め切りに引っかかってタイルを飛ばしたら true
+	bool isOutOfTime() const { return outOfTime; }
+
+	const Tile& getTile( int tileIndex ) const { return tiles[tileIndex]; }
+	int getTileCount() const { return (int)tiles.size(); }
+
+	// タイルを描いたスレッドがそのまま呼んでいい. 反映されるのは次の reset から
+	void setConverged( int tileIndex ) { converged[tileIndex] = 1; }
+	int getActiveTileCount() const;
+
+private:
+	// 隣のキューと同じキャッシュラインに乗らないように
+	struct alignas(64) Queue {
+		std::mutex mutex;
+		std::deque<int> tiles;
+	};
+
+	bool pop( int threadIndex, int *tileIndex );
+	bool steal( int threadIndex, int *tileIndex );
+	double predictSeconds( int tileIndex, int samples ) const;
+
+	std::vector<Tile> tiles;
+	std::vector<uint8_t> converged; // 別々のスレッドが書くので vector<bool> にはしない
+	std::vector<std::unique_ptr<Queue>> queues;
+
+	Clock::time_point deadline = Clock::time_point::max();
+	std::atomic<bool> outOfTime{ false };
+	std::vector<double> secondsPerSample; // タイルごと. まだ測っていなければ負
+	// 測っていないタイルは測ったタイル全体の平均で見積もる
+	std::atomic<int64_t> measuredNanoseconds{ 0 };
+	std::atomic<int64_t> measuredSamples{ 0 };
+};
@@ -72,6 +72,7 @@ struct Vector3 {
 		z = v.z;
 		return *this;
 	}
+	inline float operator[]( int i ) const { return ( &x )[i]; }
 	inline bool operator==( const Vector3 &v ) const { return x == v.x && y == v.y && z == v.z; }
 	inline bool operator!=( const Vector3 &v ) const { return !( ( *this ) == v ); }
 